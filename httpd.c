@@ -10,8 +10,6 @@
  *
  */
 
-#define     __STDC_WANT_LIB_EXT1__  1
-
 #define     __HTTPD_DEBUG__         0
 
 #include    <stdlib.h>
@@ -46,16 +44,25 @@
 #define     SESS_BUFF_SIZE          512
 #define     MAX_ACTIVE_SESS         (TCP_PCB_COUNT-1)
 
-#define     CMD_DELIM               "\r\n"                  // command line white-space delimiters
-#define     FIELD_DELIM             " \t"
 #define     FILE_SPEC_LEN           256
-#define     SCRATCH_PAD             FILE_SPEC_LEN
-#define     WWW_ROOT_DIR            "b:\\www"
-#define     WWW_ROOT_PAGE           "\\index.htm"
+#define     HTTP_TOKEN_LEN          16                      // longest request token the parser needs to compare
+#define     HTTP_MAX_REQ_HEADER     4096                    // max request header bytes accepted before failing the request
+#define     WWW_ROOT_DIR            "b:\\www"                // DOS file back-end directory
+#define     WWW_ROOT_PAGE           "/index.htm"
+#define     WWW_ROMFS_IMAGE         "b:\\www.img"            // ROMFS image made by mkromfs.py, DOS files are used if not found
+#define     ROMFS_MAGIC             "WROM"
+#define     ROMFS_VERSION           2
+#define     HTTP_DEFAULT_MIME       "text/html"
 #define     HTTP_RESP_HEADER        "HTTP/1.1 %s\r\n"                       \
                                     "Server: Flashlite NEC V25 v1.0\r\n"    \
-                                    "Content-Type: text/html\r\n"           \
-                                    "\r\n\0"
+                                    "Content-Type: %s\r\n"                  \
+                                    "Content-Length: %ld\r\n"               \
+                                    "Connection: %s\r\n\0"
+#define     HTTP_RESP_ETAG          "ETag: \"%08lx\"\r\n\0"
+#define     HTTP_RESP_END           "\r\n"
+
+#define     HTTP_KEEPALIVE_TIMEOUT  15000UL                 // mSec idle time before a persistent connection is closed
+#define     HTTP_MAX_KEEPALIVE_REQ  20                      // max requests served on one persistent connection
 
 #define     DUMMY_TEST_PAGE         "<html> \r\n"                                                   \
                                     "<head>\r\n"                                                    \
@@ -91,36 +98,112 @@ typedef enum
 typedef enum
 {
     HTTP_200_OK,
+    HTTP_304_NOT_MODIFIED,
     HTTP_400_BAD_REQUEST,
     HTTP_404_NOT_FOUND,
     HTTP_501_NOT_IMPLEMENTED,
     HTTP_505_HTTP_VERSION_NOT_SUPPORTED
 } http_resp_code_t;
 
+typedef enum
+{
+    HTTP_PARSE_METHOD,                              // must be '0' so a cleared parser starts a new request
+    HTTP_PARSE_TARGET,
+    HTTP_PARSE_VERSION,
+    HTTP_PARSE_HDR_NAME,
+    HTTP_PARSE_HDR_VALUE,
+    HTTP_PARSE_HDR_SKIP,
+    HTTP_PARSE_DONE
+} http_parse_state_t;
+
+typedef enum
+{
+    HTTP_HDR_NONE,
+    HTTP_HDR_CONNECTION,
+    HTTP_HDR_IF_NONE_MATCH
+} http_header_t;
+
 struct http_req_t
 {
     http_cmd_t          command;
     http_resp_code_t    status;
-    char                pageRef[FILE_SPEC_LEN];
+    int                 keepAlive;                  // '1' connection persists after the response, '0' close it
+    char                ifNoneMatch[HTTP_TOKEN_LEN];// ETag the client has cached
+    char                pageRef[FILE_SPEC_LEN];     // request path
+};
+
+struct http_parser_t
+{
+    http_parse_state_t  state;
+    http_header_t       header;                     // header whose value is being parsed
+    int                 hdrBytes;                   // request header bytes consumed so far
+    int                 refLen;                     // length of text in request.pageRef
+    int                 tokenLen;
+    char                token[HTTP_TOKEN_LEN];      // method, version, header name or value being parsed
 };
 
 struct http_resource_t
 {
-    char                fileSpec[FILE_SPEC_LEN];
-    FILE               *hFile;
+    char                fileSpec[FILE_SPEC_LEN];    // request path of the resource
+    FILE               *hFile;                      // DOS file or the shared ROMFS image
+    long                fileOffset;                 // resource content offset in hFile
     long                fileLen;
+    char               *mimeType;
+    uint32_t            etag;                       // '0' if resource has no ETag
+    uint16_t           *blockSum;                   // precomputed checksum per ROMFS block, NULL if none
     int                 refCount;
 };
 
+/* ROMFS image header and index entry, as written by mkromfs.py
+ * little-endian integers are read directly into the packed structures
+ */
+struct romfs_header_t
+{
+    char                magic[4];
+    uint16_t            version;
+    uint16_t            entryCount;
+    uint32_t            dataStart;                  // end of header, index, string table and block checksums
+    uint32_t            imageLen;
+    uint16_t            blockSize;                  // content bytes per block checksum
+    uint16_t            reserved;
+};
+
+struct romfs_entry_t
+{
+    uint32_t            pathOffset;
+    uint32_t            dataOffset;
+    uint32_t            length;
+    uint32_t            etag;
+    uint32_t            mimeOffset;
+    uint32_t            sumOffset;
+};
+
+struct romfs_t
+{
+    FILE                   *hImage;                 // NULL if no image is mounted
+    long                    imagePos;               // current read position in image file
+    uint8_t                *meta;                   // image header, index and strings loaded from the image
+    struct romfs_entry_t   *index;
+    int                     entryCount;
+    int                     blockSize;              // '0' if block checksums are not used
+};
+
 struct http_session_t
 {
     http_handler_state_t    state;
     pcbid_t                 connection;
     struct http_req_t       request;
+    struct http_parser_t    parser;
     int                     resourceId;
     long                    filePos;
-    int                     recvBytes;
-    uint8_t                 data[SESS_BUFF_SIZE];
+    int                     recvBytes;              // valid bytes in recvData
+    int                     recvPos;                // next recvData byte to parse, bytes up to recvBytes belong to pipelined requests
+    int                     respBytes;              // response header length
+    int                     respSent;               // response header bytes already queued with tcp_send()
+    int                     reqCount;               // requests served on this connection
+    uint32_t                lastActive;             // time stamp of connection accept or last completed response
+    uint8_t                 data[SESS_BUFF_SIZE];   // response header
+    uint8_t                 recvData[SESS_BUFF_SIZE];
 };
 
 /*================================================
@@ -132,7 +215,9 @@ struct http_session_t   sessions[MAX_ACTIVE_SESS];
 int                     activeSessions;
 struct http_resource_t  resources[MAX_RESOURCES];
 int                     openResources;
+struct romfs_t          romfs;
 char   *httpResponse[] = { "200 OK",
+                           "304 NOT MODIFIED",
                            "400 BAD REQUEST",
                            "404 NOT FOUND",
                            "501 NOT IMPLEMENTED",
@@ -145,13 +230,20 @@ char   *httpResponse[] = { "200 OK",
 void  notify_callback(pcbid_t, tcp_event_t);
 void  accept_callback(pcbid_t);
 
+int   romfs_mount(char*);
+struct romfs_entry_t* romfs_lookup(char*);
+
 int   resource_open(char*);
 int   resource_read(int, long, uint8_t*, int);
+int   resource_sum(int, long, int, uint16_t*);
 int   resource_eof(int, long);
 int   resource_close(int);
+int   resource_producer(void*, uint32_t, uint8_t*, uint16_t, uint16_t*);
 
 void  http_session_clear(int);
-char* get_text_field(char*, char*, int, char*);
+void  http_session_done(int);
+void  http_parse_token(struct http_parser_t*, char);
+int   http_parse_request(int, uint8_t*, int);
 int   send_http_resp_header(int);
 int   http_session_handler(int);
 
@@ -254,6 +346,10 @@ int main(int argc, char* argv[])
     {
          memset(&(resources[i]), 0, sizeof(struct http_resource_t));;
     }
+    if ( romfs_mount(WWW_ROMFS_IMAGE) == 0 )
+        printf("Mounted %s with %d files\n", WWW_ROMFS_IMAGE, romfs.entryCount);
+    else
+        printf("Serving files from %s\n", WWW_ROOT_DIR);
     printf("Created listening connection ID %d\n", tcpListner);
 
     /* initialize LCD display with info text
@@ -463,6 +559,7 @@ void accept_callback(pcbid_t connection)
         {
             sessions[i].state = WAITING;
             sessions[i].connection = connection;
+            sessions[i].lastActive = stack_time();
             activeSessions++;
             printf("[s:%d/%d,c:%d] Accepted connection %d from: %s:%u\n", i, activeSessions, connection, connection, ip, tcp_remote_port(connection));
 
@@ -483,24 +580,190 @@ void accept_callback(pcbid_t connection)
  *  open, read and close functions manage file read pointer placement
  *  and open/close coordination from multiple sources for the same
  *  resource file.
+ *  resources are served from a ROMFS image when one is mounted,
+ *  or from individual DOS files under WWW_ROOT_DIR if not.
  *
  */
 
+/*------------------------------------------------
+ * romfs_mount()
+ *
+ *  open a ROMFS image made by mkromfs.py and load its header, sorted path index
+ *  and string table to memory. the image file stays open, and all
+ *  ROMFS resources are read through its file handle.
+ *
+ * param:  image file name
+ * return: '-1' if image open error or bad image,
+ *         '0' if image is mounted
+ */
+int romfs_mount(char *imageSpec)
+{
+    struct romfs_header_t   header;
+    struct romfs_entry_t   *entry;
+    FILE                   *fh;
+    long                    imageSize;
+    uint32_t                sums;
+    char                   *path, *prevPath;
+    uint16_t                i;
+
+    fh = fopen(imageSpec, "rb");
+    if ( fh == NULL )
+        return -1;
+
+    /* validate the header and make sure the meta data
+     * can be loaded into one memory block and holds the index
+     */
+    if ( fread(&header, 1, sizeof(struct romfs_header_t), fh) != sizeof(struct romfs_header_t) ||
+         memcmp(header.magic, ROMFS_MAGIC, sizeof(header.magic)) != 0 ||
+         header.version != ROMFS_VERSION ||
+         header.dataStart > 0xfff0UL ||
+         (uint32_t) sizeof(struct romfs_header_t) + (uint32_t) header.entryCount * sizeof(struct romfs_entry_t) > header.dataStart ||
+         header.imageLen < header.dataStart )
+    {
+        printf("  romfs_mount() bad image [%s]\n", imageSpec);
+        fclose(fh);
+        return -1;
+    }
+
+    /* the image file must hold all the content the header claims
+     */
+    fseek(fh, 0L, SEEK_END);
+    imageSize = ftell(fh);
+    if ( imageSize < 0 || (uint32_t) imageSize < header.imageLen )
+    {
+        printf("  romfs_mount() truncated image [%s]\n", imageSpec);
+        fclose(fh);
+        return -1;
+    }
+
+    romfs.meta = malloc((size_t) header.dataStart);
+    if ( romfs.meta == NULL )
+    {
+        printf("  romfs_mount() out of memory [%s]\n", imageSpec);
+        fclose(fh);
+        return -1;
+    }
+
+    fseek(fh, 0L, SEEK_SET);
+    if ( fread(romfs.meta, 1, (size_t) header.dataStart, fh) != (size_t) header.dataStart )
+    {
+        printf("  romfs_mount() read error [%s]\n", imageSpec);
+        free(romfs.meta);
+        fclose(fh);
+        return -1;
+    }
+
+    /* validate that the strings and block checksums of all index entries
+     * are inside the meta data, that their content is inside the image,
+     * and that the index is sorted by path for romfs_lookup(), so that
+     * a truncated or stale image is not used and resources are served
+     * from DOS files instead
+     */
+    entry = (struct romfs_entry_t*) &(romfs.meta[sizeof(struct romfs_header_t)]);
+    prevPath = NULL;
+    for (i = 0; i < header.entryCount; i++, entry++)
+    {
+        if ( entry->pathOffset >= header.dataStart ||
+             entry->mimeOffset >= header.dataStart ||
+             memchr(&(romfs.meta[entry->pathOffset]), 0, (size_t) (header.dataStart - entry->pathOffset)) == NULL ||
+             memchr(&(romfs.meta[entry->mimeOffset]), 0, (size_t) (header.dataStart - entry->mimeOffset)) == NULL )
+            break;
+
+        if ( entry->dataOffset < header.dataStart ||
+             entry->dataOffset > header.imageLen ||
+             entry->length > (header.imageLen - entry->dataOffset) )
+            break;
+
+        path = (char*) &(romfs.meta[entry->pathOffset]);
+        if ( prevPath != NULL && strcmp(prevPath, path) >= 0 )
+            break;
+        prevPath = path;
+
+        if ( header.blockSize > 0 )
+        {
+            sums = entry->length / header.blockSize;
+            if ( (entry->length % header.blockSize) != 0 )
+                sums++;
+            if ( entry->sumOffset > header.dataStart ||
+                 sums > (header.dataStart - entry->sumOffset) / sizeof(uint16_t) )
+                break;
+        }
+    }
+
+    if ( i < header.entryCount )
+    {
+        printf("  romfs_mount() bad image [%s]\n", imageSpec);
+        free(romfs.meta);
+        fclose(fh);
+        return -1;
+    }
+
+    romfs.hImage = fh;
+    romfs.imagePos = (long) header.dataStart;
+    romfs.index = (struct romfs_entry_t*) &(romfs.meta[sizeof(struct romfs_header_t)]);
+    romfs.entryCount = header.entryCount;
+
+    /* block checksums are used only if a block fits in a TCP segment
+     */
+    if ( header.blockSize > 0 && header.blockSize <= MSS )
+        romfs.blockSize = header.blockSize;
+    else
+        romfs.blockSize = 0;
+
+    return 0;
+}
+
+/*------------------------------------------------
+ * romfs_lookup()
+ *
+ *  binary search of the sorted ROMFS path index
+ *
+ * param:  request path
+ * return: pointer to index entry, NULL if not found
+ */
+struct romfs_entry_t* romfs_lookup(char *path)
+{
+    int         low, high, mid;
+    int         result;
+
+    low = 0;
+    high = romfs.entryCount - 1;
+
+    while ( low <= high )
+    {
+        mid = (low + high) / 2;
+        result = strcmp(path, (char*) &(romfs.meta[romfs.index[mid].pathOffset]));
+        if ( result == 0 )
+            return &(romfs.index[mid]);
+        else if ( result < 0 )
+            high = mid - 1;
+        else
+            low = mid + 1;
+    }
+
+    return NULL;
+}
+
 /*------------------------------------------------
  * resource_open()
  *
- *  open a file resource for reading. the file name
- *  should be a fully qualified name including the base WWW server directory
- *  and with proper (OS dependent) directory name separators
+ *  open a resource for reading. the resource is identified by its
+ *  request path, and is looked up in the ROMFS image if one is mounted.
+ *  otherwise the path is translated to a DOS file name in the base
+ *  WWW server directory and with proper (OS dependent) directory name separators
  *
- * param:  valid file name
+ * param:  request path
  * return: '-1' if file open error (not found),
  *         '0' or positive number of open resource reference
  */
-int resource_open(char *fileSpec)
+int resource_open(char *path)
 {
-    int         i, freeSlot = 0;
-    FILE       *fh;
+    static char             fileSpec[FILE_SPEC_LEN];
+
+    int                     i, freeSlot = 0;
+    FILE                   *fh;
+    struct romfs_entry_t   *entry;
+    char                   *cp;
 
     if ( openResources == MAX_RESOURCES )
         return -1;
@@ -514,11 +777,11 @@ int resource_open(char *fileSpec)
     {
         for (i = 0; i < MAX_RESOURCES; i++)
         {
-            if ( strcmp(fileSpec, resources[i].fileSpec) == 0 )
+            if ( strcmp(path, resources[i].fileSpec) == 0 )
             {
                 resources[i].refCount++;
 #if __HTTPD_DEBUG__
-                printf("  [%s] ref count = %d\n", fileSpec, resources[i].refCount);
+                printf("  [%s] ref count = %d\n", path, resources[i].refCount);
 #endif
                 return i;
             }
@@ -532,28 +795,64 @@ int resource_open(char *fileSpec)
     /* at this point we've determined that there is no matching
      * open resource, so we need to open the requested resource.
      * use the 'freeSlot' found above.
-     * initialize the file size and the reference count to '1'
+     * a ROMFS resource shares the image file handle and gets its
+     * length, type and ETag from the index
      */
-    fh = fopen(fileSpec, "rb");
-    if ( fh != NULL )
+    if ( romfs.hImage != NULL )
     {
-        /* TODO using strncpy() here is probably not safe if src string
-         * is longer than dst string.
-         */
-        strncpy(resources[freeSlot].fileSpec, fileSpec, FILE_SPEC_LEN);
-        resources[freeSlot].hFile = fh;
+        entry = romfs_lookup(path);
+        if ( entry == NULL )
+            return -1;
+
+        fh = romfs.hImage;
+        resources[freeSlot].fileOffset = (long) entry->dataOffset;
+        resources[freeSlot].fileLen = (long) entry->length;
+        resources[freeSlot].mimeType = (char*) &(romfs.meta[entry->mimeOffset]);
+        resources[freeSlot].etag = entry->etag;
+        resources[freeSlot].blockSum = romfs.blockSize ? (uint16_t*) &(romfs.meta[entry->sumOffset]) : NULL;
+    }
+
+    /* form a proper file specifier that is appropriate for DOS,
+     * with '\' directory name delimiters, and open the file.
+     * initialize the file size
+     */
+    else
+    {
+        strcpy(fileSpec, WWW_ROOT_DIR);
+        strcat(fileSpec, path);
+        cp = strchr(fileSpec, '/');
+        while ( cp != NULL )
+        {
+            *cp = '\\';
+            cp = strchr(cp, '/');
+        }
+
+        fh = fopen(fileSpec, "rb");
+        if ( fh == NULL )
+        {
+            printf("  resource_open() open error [%s]\n", fileSpec);
+            return -1;
+        }
+
         fseek(fh, 0L, SEEK_END);
+        resources[freeSlot].fileOffset = 0L;
         resources[freeSlot].fileLen = ftell(fh);
-        resources[freeSlot].refCount = 1;
-        openResources++;
-#if __HTTPD_DEBUG__
-        printf("  [%s] ref count = %d\n", fileSpec, resources[freeSlot].refCount);
-#endif
-        return freeSlot;
+        resources[freeSlot].mimeType = HTTP_DEFAULT_MIME;
+        resources[freeSlot].etag = 0;
+        resources[freeSlot].blockSum = NULL;
     }
 
-    printf("  resource_open() open error [%s]\n", fileSpec);
-    return -1;
+    /* TODO using strncpy() here is probably not safe if src string
+     * is longer than dst string.
+     */
+    strncpy(resources[freeSlot].fileSpec, path, FILE_SPEC_LEN);
+    resources[freeSlot].hFile = fh;
+    resources[freeSlot].refCount = 1;
+    openResources++;
+#if __HTTPD_DEBUG__
+    printf("  [%s] ref count = %d\n", path, resources[freeSlot].refCount);
+#endif
+    return freeSlot;
 }
 
 /*------------------------------------------------
@@ -570,7 +869,7 @@ int resource_open(char *fileSpec)
 int resource_read(int resource, long position, uint8_t *buffer, int readCount)
 {
     int         result;
-    size_t      bytes;
+    long        bytes;
 
     if ( resource >= MAX_RESOURCES ||
          resource < 0 )
@@ -579,23 +878,34 @@ int resource_read(int resource, long position, uint8_t *buffer, int readCount)
     /* get the resource in the resources[] table and validate that it is open,
      * reposition read pointer with fseek() and issue an fread() to
      * return the requested number of bytes.
+     * the ROMFS image read position is tracked, so sequential reads of a
+     * resource do not need an fseek()
      */
     if ( resources[resource].hFile != NULL )
     {
-        result = fseek(resources[resource].hFile, position, SEEK_SET);
+        position += resources[resource].fileOffset;
+
+        if ( resources[resource].hFile == romfs.hImage &&
+             romfs.imagePos == position )
+            result = 0;
+        else
+            result = fseek(resources[resource].hFile, position, SEEK_SET);
+
         if ( result == 0 )
         {
             /* determine the max number of bytes to read between what is left
              * in the resource file and the requested bytes count.
              * the size of available buffer should have been accounted
              * for before calling read_resource()!
-             * TODO the way this is implemented only allows files that
-             * are 64KB or less
              */
-            bytes = (size_t)(resources[resource].fileLen - position);
-            if ( bytes > readCount )
-                bytes = readCount;
-            result = fread(buffer, 1, bytes, resources[resource].hFile);
+            bytes = resources[resource].fileOffset + resources[resource].fileLen - position;
+            if ( bytes > (long) readCount )
+                bytes = (long) readCount;
+            result = fread(buffer, 1, (size_t) bytes, resources[resource].hFile);
+
+            if ( resources[resource].hFile == romfs.hImage )
+                romfs.imagePos = position + result;
+
             return result;
         }
     }
@@ -604,6 +914,41 @@ int resource_read(int resource, long position, uint8_t *buffer, int readCount)
     return -1;
 }
 
+/*------------------------------------------------
+ * resource_sum()
+ *
+ *  get the precomputed checksum of a range of a resource.
+ *  a checksum is only available for a range that is exactly one
+ *  ROMFS block, or the last partial block of the resource.
+ *
+ * param:  valid resource ID, file position, byte count, pointer to checksum output
+ * return: '-1' if no checksum for the range,
+ *         '0' if checksum is valid, as returned by stack_checksum()
+ */
+int resource_sum(int resource, long position, int count, uint16_t *sum)
+{
+    long        bytes;
+
+    if ( resource >= MAX_RESOURCES ||
+         resource < 0 )
+        return -1;
+
+    if ( resources[resource].hFile == NULL ||
+         resources[resource].blockSum == NULL ||
+         (position % romfs.blockSize) != 0 )
+        return -1;
+
+    bytes = resources[resource].fileLen - position;
+    if ( bytes > (long) romfs.blockSize )
+        bytes = (long) romfs.blockSize;
+    if ( bytes != (long) count )
+        return -1;
+
+    *sum = resources[resource].blockSum[(int)(position / romfs.blockSize)];
+
+    return 0;
+}
+
 /*------------------------------------------------
  * resource_eof()
  *
@@ -640,6 +985,7 @@ int resource_eof(int resource, long position)
  * resource_close()
  *
  *  close a resource.
+ *  the ROMFS image file stays open when its resources are closed.
  *
  * param:  valid resource ID
  * return: '-1' if read error,
@@ -647,7 +993,7 @@ int resource_eof(int resource, long position)
  */
 int resource_close(int resource)
 {
-    int         result;
+    int         result = 0;
 
     if ( resource >= MAX_RESOURCES ||
          resource < 0 )
@@ -662,13 +1008,15 @@ int resource_close(int resource)
         resources[resource].refCount--;
         if ( resources[resource].refCount == 0 )
         {
-            result = fclose(resources[resource].hFile);
+            if ( resources[resource].hFile != romfs.hImage )
+                result = fclose(resources[resource].hFile);
 #if __HTTPD_DEBUG__
             printf("  fclose() [%s] status %d\n", resources[resource].fileSpec, result);
 #endif
             if ( result == 0 )
             {
                 resources[resource].hFile = NULL;
+                resources[resource].fileOffset = 0L;
                 resources[resource].fileLen = 0L;
                 resources[resource].refCount = 0;
                 memset(resources[resource].fileSpec, 0, FILE_SPEC_LEN);
@@ -687,6 +1035,43 @@ int resource_close(int resource)
     return -1;
 }
 
+/*------------------------------------------------
+ * resource_producer()
+ *
+ *  TCP producer call-back that reads a session's resource directly into
+ *  an outgoing segment. a ROMFS resource is read one block at a time, so
+ *  that the block's precomputed checksum can be returned with it.
+ *
+ * param:  pointer to session, resource position, segment buffer pointer,
+ *         max bytes to read, pointer to checksum output
+ * return: number of bytes read, '0' if none or read error
+ */
+int resource_producer(void *ctx, uint32_t offset, uint8_t *buffer, uint16_t maxLen, uint16_t *sum)
+{
+    struct http_session_t  *sess;
+    int                     readCount, result;
+    uint16_t                blockBytes;
+
+    sess = (struct http_session_t*) ctx;
+
+    readCount = maxLen;
+    if ( resources[sess->resourceId].blockSum != NULL )
+    {
+        blockBytes = romfs.blockSize - (uint16_t)(offset % romfs.blockSize);
+        if ( readCount > blockBytes )
+            readCount = blockBytes;
+    }
+
+    result = resource_read(sess->resourceId, (long) offset, buffer, readCount);
+    if ( result <= 0 )
+        return 0;
+
+    resource_sum(sess->resourceId, (long) offset, result, sum);
+    sess->filePos = (long) offset + result;
+
+    return result;
+}
+
 /*================================================
  * HTTPD page server module
  *
@@ -709,46 +1094,310 @@ void http_session_clear(int httpSes)
 }
 
 /*------------------------------------------------
- * get_text_field()
+ * http_session_done()
  *
- * param:  source text string to search/process,
- *         list of field delimiter characters,
- *         field number to return (0-based),
- *         pointer to text buffer holding the field text
- * return: pointer to text field, NULL is none found
+ *  called when a response has been fully handed to TCP.
+ *  release the resource, and either loop the session back to
+ *  the next request on a persistent connection or close it.
+ *  a request the client pipelined behind the one just served is
+ *  already in the receive buffer, so parse it right away.
+ *
+ * param:  session structure ID
+ * return: none
  *
  */
-char* get_text_field(char *line, char *delim, int fieldNum, char *textField)
+void http_session_done(int httpSes)
 {
-    static char scratchPad[SCRATCH_PAD];
+    struct http_session_t  *sess;
 
-    char       *field;
-    int         i = 0;
+    sess = &(sessions[httpSes]);
 
-    strcpy(scratchPad, line);
-    field = strtok(scratchPad, delim);
-    while ( field != NULL && i < fieldNum )
+    if ( sess->request.keepAlive )
+    {
+        resource_close(sess->resourceId);
+        memset(&(sess->request), 0, sizeof(struct http_req_t));
+        memset(&(sess->parser), 0, sizeof(struct http_parser_t));
+        sess->resourceId = NO_RESOURCE;
+        sess->filePos = 0L;
+        sess->respBytes = 0;
+        sess->respSent = 0;
+        sess->lastActive = stack_time();
+        if ( sess->recvPos < sess->recvBytes )
+            sess->state = PARSE_HEADER;
+        else
+            sess->state = WAITING;
+    }
+    else
     {
-        field = strtok(NULL, delim);
-        i++;
+        sess->state = CLOSE;
     }
+}
 
-    if ( field != NULL )
+/*------------------------------------------------
+ * http_parse_token()
+ *
+ *  append a character to the parser's token buffer.
+ *  characters that do not fit are dropped, this is safe because a truncated
+ *  token is longer than any of the keywords it will be compared to.
+ *
+ * param:  pointer to session parser, character
+ * return: none
+ *
+ */
+void http_parse_token(struct http_parser_t *parser, char c)
+{
+    if ( parser->tokenLen < (HTTP_TOKEN_LEN-1) )
     {
-        strcpy(textField, field);
+        parser->token[parser->tokenLen] = c;
+        parser->tokenLen++;
     }
-    else
+}
+
+/*------------------------------------------------
+ * http_parse_request()
+ *
+ *  incremental HTTP request header parser.
+ *  the parser consumes received bytes one at a time and keeps its state in the
+ *  session, so a request header can arrive split over any number of segments
+ *  and no byte is scanned twice. only the method, the target, the version, and the
+ *  'Connection' and 'If-None-Match' headers are extracted, all other header lines
+ *  are skipped. the request target is written directly into the request's path.
+ *
+ * param:  session structure ID, pointer to received bytes, byte count
+ * return: number of bytes consumed. parsing stops after the empty line
+ *         that terminates the request header or after a malformed request,
+ *         with the parser state set to HTTP_PARSE_DONE
+ *
+ */
+int http_parse_request(int httpSes, uint8_t *buffer, int count)
+{
+    struct http_parser_t   *parser;
+    struct http_req_t      *req;
+    int                     i;
+    char                    c;
+
+    parser = &(sessions[httpSes].parser);
+    req = &(sessions[httpSes].request);
+
+    for ( i = 0; i < count && parser->state != HTTP_PARSE_DONE; i++ )
     {
-        textField[0] = '\0';
+        c = (char) buffer[i];
+
+        /* lines end with LF and an optional CR, so ignore all CRs
+         */
+        if ( c == '\r' )
+            continue;
+
+        parser->hdrBytes++;
+        if ( parser->hdrBytes > HTTP_MAX_REQ_HEADER )
+        {
+            req->command = HTTP_BAD_REQ;
+            req->status = HTTP_400_BAD_REQUEST;
+            parser->state = HTTP_PARSE_DONE;
+            continue;
+        }
+
+        switch ( parser->state )
+        {
+            /* request method, empty lines ahead of the request line are ignored
+             */
+            case HTTP_PARSE_METHOD:
+                if ( c == ' ' )
+                {
+                    parser->token[parser->tokenLen] = '\0';
+                    parser->tokenLen = 0;
+
+                    if ( strcmp(parser->token, "GET") == 0 )
+                    {
+                        req->command = HTTP_GET;
+                    }
+                    else if ( strcmp(parser->token, "HEAD") == 0 )
+                    {
+                        req->command = HTTP_HEAD;
+                    }
+                    else
+                    {
+                        req->command = HTTP_BAD_REQ;
+                        req->status = HTTP_400_BAD_REQUEST;
+                        parser->state = HTTP_PARSE_DONE;
+                        break;
+                    }
+
+                    req->status = HTTP_200_OK;
+                    parser->refLen = 0;
+                    parser->state = HTTP_PARSE_TARGET;
+                }
+                else if ( c == '\n' )
+                {
+                    if ( parser->tokenLen > 0 )
+                    {
+                        req->command = HTTP_BAD_REQ;
+                        req->status = HTTP_400_BAD_REQUEST;
+                        parser->state = HTTP_PARSE_DONE;
+                    }
+                }
+                else
+                {
+                    http_parse_token(parser, c);
+                }
+                break;
+
+            /* request target path, leaving room for the DOS back-end's directory prefix.
+             * a request line without a version is an HTTP/0.9 request
+             * that has no header lines
+             */
+            case HTTP_PARSE_TARGET:
+                if ( c == ' ' || c == '\n' )
+                {
+                    if ( parser->refLen == 0 )
+                    {
+                        if ( c == ' ' )
+                            break;
+
+                        req->command = HTTP_BAD_REQ;
+                        req->status = HTTP_400_BAD_REQUEST;
+                        parser->state = HTTP_PARSE_DONE;
+                    }
+                    else if ( c == ' ' )
+                    {
+                        parser->state = HTTP_PARSE_VERSION;
+                    }
+                    else
+                    {
+                        parser->state = HTTP_PARSE_DONE;
+                    }
+                }
+                else if ( parser->refLen < (FILE_SPEC_LEN - sizeof(WWW_ROOT_DIR)) )
+                {
+                    req->pageRef[parser->refLen] = c;
+                    parser->refLen++;
+                    req->pageRef[parser->refLen] = '\0';
+                }
+                else
+                {
+                    req->command = HTTP_BAD_REQ;
+                    req->status = HTTP_400_BAD_REQUEST;
+                    parser->state = HTTP_PARSE_DONE;
+                }
+                break;
+
+            /* HTTP/1.1 connections are persistent by default, anything
+             * older closes unless a 'Connection' header says otherwise.
+             * TODO: for simplicity we will accept any version.
+             * if version other that 1.x is present set 'status' to
+             * HTTP_505_HTTP_VERSION_NOT_SUPPORTED and 'command' to HTTP_BAD_REQ
+             */
+            case HTTP_PARSE_VERSION:
+                if ( c == '\n' )
+                {
+                    parser->token[parser->tokenLen] = '\0';
+                    parser->tokenLen = 0;
+                    if ( strcmp(parser->token, "HTTP/1.1") == 0 )
+                        req->keepAlive = 1;
+                    parser->state = HTTP_PARSE_HDR_NAME;
+                }
+                else
+                {
+                    http_parse_token(parser, c);
+                }
+                break;
+
+            /* header name, an empty line ends the request header.
+             * a line without a ':' is ignored
+             */
+            case HTTP_PARSE_HDR_NAME:
+                if ( c == '\n' )
+                {
+                    if ( parser->tokenLen == 0 )
+                        parser->state = HTTP_PARSE_DONE;
+                    parser->tokenLen = 0;
+                }
+                else if ( c == ':' )
+                {
+                    parser->token[parser->tokenLen] = '\0';
+                    parser->tokenLen = 0;
+                    if ( stricmp(parser->token, "Connection") == 0 )
+                    {
+                        parser->header = HTTP_HDR_CONNECTION;
+                        parser->state = HTTP_PARSE_HDR_VALUE;
+                    }
+                    else if ( stricmp(parser->token, "If-None-Match") == 0 )
+                    {
+                        parser->header = HTTP_HDR_IF_NONE_MATCH;
+                        parser->state = HTTP_PARSE_HDR_VALUE;
+                    }
+                    else
+                    {
+                        parser->state = HTTP_PARSE_HDR_SKIP;
+                    }
+                }
+                else
+                {
+                    http_parse_token(parser, c);
+                }
+                break;
+
+            /* value of a header we act on, without leading and trailing white space
+             */
+            case HTTP_PARSE_HDR_VALUE:
+                if ( c == '\n' )
+                {
+                    while ( parser->tokenLen > 0 &&
+                            (parser->token[parser->tokenLen-1] == ' ' || parser->token[parser->tokenLen-1] == '\t') )
+                        parser->tokenLen--;
+                    parser->token[parser->tokenLen] = '\0';
+                    parser->tokenLen = 0;
+
+                    if ( parser->header == HTTP_HDR_CONNECTION )
+                    {
+                        if ( stricmp(parser->token, "close") == 0 )
+                            req->keepAlive = 0;
+                        else if ( stricmp(parser->token, "keep-alive") == 0 )
+                            req->keepAlive = 1;
+                    }
+                    else if ( parser->header == HTTP_HDR_IF_NONE_MATCH )
+                    {
+                        strcpy(req->ifNoneMatch, parser->token);
+                    }
+
+                    parser->header = HTTP_HDR_NONE;
+                    parser->state = HTTP_PARSE_HDR_NAME;
+                }
+                else if ( (c == ' ' || c == '\t') && parser->tokenLen == 0 )
+                {
+                    break;
+                }
+                else
+                {
+                    http_parse_token(parser, c);
+                }
+                break;
+
+            /* value of a header we don't act on
+             */
+            case HTTP_PARSE_HDR_SKIP:
+                if ( c == '\n' )
+                    parser->state = HTTP_PARSE_HDR_NAME;
+                break;
+
+            /* should not get here
+             */
+            default:
+                assert(0);
+        }
     }
 
-    return field;
+    return i;
 }
 
 /*------------------------------------------------
  * send_http_resp_header()
  *
- *  outputs an HTTP response header
+ *  outputs an HTTP response header. the header is formatted into the
+ *  session buffer on the first call, and subsequent calls queue whatever
+ *  part of it did not fit into the TCP send buffer.
+ *  the header of a response with a body is not pushed, so that TCP
+ *  sends it in one segment with the beginning of the body.
  *
  * param:  the ID of an accepted HTTP connection,
  * return: integer result of tcp_send()
@@ -756,15 +1405,49 @@ char* get_text_field(char *line, char *delim, int fieldNum, char *textField)
  */
 int send_http_resp_header(int httpSes)
 {
-    uint8_t            *buffer;
-    struct http_req_t  *req;
+    uint8_t                *buffer;
+    struct http_req_t      *req;
+    struct http_resource_t *resource = NULL;
+    long                    contentLen = 0L;
+    int                     result;
+    uint16_t                flags = 0;
 
     buffer = sessions[httpSes].data;
     req = &(sessions[httpSes].request);
 
-    sprintf(buffer, HTTP_RESP_HEADER, httpResponse[req->status]);
+    if ( req->command == HTTP_HEAD ||                                   // these responses have no body
+         req->command == HTTP_BAD_REQ ||
+         req->status == HTTP_304_NOT_MODIFIED )
+        flags = TCP_FLAG_PSH;
+
+    if ( sessions[httpSes].respBytes == 0 )
+    {
+        if ( req->command != HTTP_BAD_REQ &&
+             sessions[httpSes].resourceId != NO_RESOURCE )
+        {
+            resource = &(resources[sessions[httpSes].resourceId]);
+            contentLen = resource->fileLen;
+        }
 
-    return tcp_send(sessions[httpSes].connection, buffer, strlen(buffer), TCP_FLAG_PSH);
+        result = sprintf(buffer, HTTP_RESP_HEADER, httpResponse[req->status],
+                         resource ? resource->mimeType : HTTP_DEFAULT_MIME,
+                         contentLen, req->keepAlive ? "keep-alive" : "close");
+        if ( resource && resource->etag )
+            result += sprintf(&buffer[result], HTTP_RESP_ETAG, resource->etag);
+        strcpy(&buffer[result], HTTP_RESP_END);
+
+        sessions[httpSes].respBytes = strlen(buffer);
+        sessions[httpSes].respSent = 0;
+    }
+
+    result = tcp_send(sessions[httpSes].connection,
+                      &buffer[sessions[httpSes].respSent],
+                      (sessions[httpSes].respBytes - sessions[httpSes].respSent),
+                      flags);
+    if ( result > 0 )
+        sessions[httpSes].respSent += result;
+
+    return result;
 }
 
 /*------------------------------------------------
@@ -783,14 +1466,8 @@ int send_http_resp_header(int httpSes)
  */
 int http_session_handler(int httpSes)
 {
-    static char         tempText[SCRATCH_PAD];
-
     int                 result;
-    char               *line;
-    char               *cp;
     struct http_req_t  *req;
-    size_t              strMaxLen;
-    char               *tempSTRTOK;
 
     req = &(sessions[httpSes].request);
 
@@ -802,170 +1479,113 @@ int http_session_handler(int httpSes)
             assert(0);
             break;
 
-        /* session is connected because a connection was accepted
-         * so we need to wait for the first segment (HTTP command)
-         * to be received
+        /* session is connected because a connection was accepted, or
+         * a previous response completed on a persistent connection,
+         * so we need to wait for the next segment of an HTTP request
+         * to be received. an idle connection is closed after a time-out.
          */
         case WAITING:
-            result = tcp_recv(sessions[httpSes].connection, sessions[httpSes].data, SESS_BUFF_SIZE);
+            result = tcp_recv(sessions[httpSes].connection, sessions[httpSes].recvData, SESS_BUFF_SIZE);
             if ( result == ERR_TCP_CLOSING )
             {
                 sessions[httpSes].state = CLOSE;
             }
-            else if ( result < 0 )
-            {
-                sessions[httpSes].recvBytes = 0;
-            }
             else if ( result > 0 )
             {
                 sessions[httpSes].recvBytes = result;
+                sessions[httpSes].recvPos = 0;
+                sessions[httpSes].lastActive = stack_time();
                 sessions[httpSes].state = PARSE_HEADER;
             }
+            else
+            {
+                if ( result < 0 )                                       // other errors may clear, but not past the idle timeout
+                {
+                    sessions[httpSes].recvBytes = 0;
+                    sessions[httpSes].recvPos = 0;
+                }
+                if ( (stack_time() - sessions[httpSes].lastActive) > HTTP_KEEPALIVE_TIMEOUT )
+                    sessions[httpSes].state = CLOSE;
+            }
 #if __HTTPD_DEBUG__
             printf("[s:%d/%d,c:%d] Receive status %d\n", httpSes, activeSessions, sessions[httpSes].connection, result);
 #endif
             break;
 
-        /* parse the received data, this is expected to be an HTTP request
-         * TODO: for simplicity, we'll assume that the entire request is contained
-         * in one segment and all of it is available if the tcp_recv() was
-         * successful.
+        /* feed the received data to the request parser. the request header
+         * may be split over several segments, so go back and wait for more
+         * data until the parser reached the end of the header.
+         * bytes past the end of the header are left in the receive buffer
+         * for the next pipelined request.
          */
         case PARSE_HEADER:
-            /* separate HTTP request into text lines and into tokens
-             * and process the HTTP request
-             */
-            result = 0;
-            strMaxLen = sessions[httpSes].recvBytes;
+            result = http_parse_request(httpSes,
+                                        &(sessions[httpSes].recvData[sessions[httpSes].recvPos]),
+                                        (sessions[httpSes].recvBytes - sessions[httpSes].recvPos));
+            sessions[httpSes].recvPos += result;
 #if __HTTPD_DEBUG__
-            printf("[s:%d/%d,c:%d] HTTP command (%d bytes):\n", httpSes, activeSessions, sessions[httpSes].connection, strMaxLen);
+            printf("[s:%d/%d,c:%d] Parsed %d bytes, parser state %d\n", httpSes, activeSessions, sessions[httpSes].connection, result, sessions[httpSes].parser.state);
 #endif
+            if ( sessions[httpSes].parser.state != HTTP_PARSE_DONE )
+            {
+                sessions[httpSes].state = WAITING;
+                break;
+            }
 
-            line = strtok_s(sessions[httpSes].data, &strMaxLen, CMD_DELIM, &tempSTRTOK);
+            sessions[httpSes].reqCount++;
 
-            while ( line != NULL )
+            /* translate a request for the root to the root web page, then
+             * try to open the resource page and save the resource identifier
+             * and initial position in the session structure. if failed to open
+             * file resource then set 'status' to HTTP_404_NOT_FOUND and
+             * 'command' to HTTP_BAD_REQ.
+             * a client that already has the resource's ETag gets a '304'
+             * response without a body
+             */
+            if ( req->command != HTTP_BAD_REQ )
             {
-#if __HTTPD_DEBUG__
-                printf("  %s\n", line);
-#endif
-
-                /* assume that first line in HTTP request holds the
-                 * HTTP command. we first parse the command and its
-                 * parameters
-                 */
-                if ( req->command == HTTP_NONE )
+                if ( strcmp(req->pageRef, "/") == 0 )
                 {
-                    /* identify the HTTP command and then
-                     * for a GET or HEAD command, retrieve the page request
-                     * for the response.
-                     */
-                    if ( strstr(line, "GET") != 0 )
-                    {
-                        req->command = HTTP_GET;
-                        req->status = HTTP_200_OK;
-                    }
-                    else if ( strstr(line, "HEAD") != 0 )
-                    {
-                        req->command = HTTP_HEAD;
-                        req->status = HTTP_200_OK;
-                    }
-                    else
-                    {
-                        req->command = HTTP_BAD_REQ;
-                        req->status = HTTP_400_BAD_REQUEST;
-                    }
-
-                    /* read the next token and if required
-                     * translate it to the root web page path
-                     */
-                    if ( req->command != HTTP_BAD_REQ &&
-                         get_text_field(line, FIELD_DELIM, 1, tempText) != NULL )
-                    {
-                        /* TODO consider using safe function strcat_s() and
-                         * strcpy_s()
-                         */
-                        strcpy(req->pageRef, WWW_ROOT_DIR);
-                        if ( strcmp(tempText, "/") == 0 )
-                        {
-                            strcat(req->pageRef, WWW_ROOT_PAGE);
-                        }
-                        else
-                        {
-                            strcat(req->pageRef, tempText);
-                        }
-
-                        /* form a proper file specifier in req->pageRef that is
-                         * appropriate for DOS, with '\' directory name delimiters
-                         */
-                        cp = strchr(req->pageRef, '/');
-                        while ( cp != NULL )
-                        {
-                            *cp = '\\';
-                            cp = strchr(cp, '/');
-                        }
-
-                        /* try to open the resource page and save
-                         * the resource identifier and initial position in the
-                         * session structure. if failed to open file resource
-                         * then set 'status' to HTTP_404_NOT_FOUND and
-                         * 'command' to HTTP_BAD_REQ
-                         */
-                        if ( (sessions[httpSes].resourceId = resource_open(req->pageRef)) >= 0 )
-                        {
-                            sessions[httpSes].filePos = 0L;
-                            sessions[httpSes].recvBytes = 0;
-                        }
-                        else
-                        {
-                            req->command = HTTP_BAD_REQ;
-                            req->status = HTTP_404_NOT_FOUND;
-                        }
-                    }
-
-                    /* TODO: for simplicity we will ignore
-                     * the HTTP version. if version other that 1.1
-                     * is present set 'status' to HTTP_505_HTTP_VERSION_NOT_SUPPORTED
-                     * and 'command' to HTTP_BAD_REQ
-                     */
+                    strcpy(req->pageRef, WWW_ROOT_PAGE);
                 }
 
-                /* if we have a valid HTTP command in the request
-                 * we now parse the rest of the request parameters
-                 * we should never get here with HTTP_BAD_REQ because
-                 * we are breaking the parsing process below
-                 */
-                else
+                if ( (sessions[httpSes].resourceId = resource_open(req->pageRef)) >= 0 )
                 {
-                    if ( strstr(line, "Host") != 0 )
-                    {
-                    }
-                    else if (strstr(line, "User-Agent") != 0 )
+                    sessions[httpSes].filePos = 0L;
+
+                    if ( resources[sessions[httpSes].resourceId].etag &&
+                         req->ifNoneMatch[0] != '\0' )
                     {
+                        sprintf(sessions[httpSes].data, "\"%08lx\"", resources[sessions[httpSes].resourceId].etag);
+                        if ( strcmp(req->ifNoneMatch, sessions[httpSes].data) == 0 )
+                            req->status = HTTP_304_NOT_MODIFIED;
                     }
                 }
-
-                /* continue parsing only if the command is well formed
-                 * and all of the header parameters are recognizable
-                 */
-                if ( req->command == HTTP_BAD_REQ )
-                {
-#if __HTTPD_DEBUG__
-                    printf("  -- bad request\n");
-#endif
-                    line = NULL;
-                }
                 else
                 {
-                    line = strtok_s(NULL, &strMaxLen, CMD_DELIM, &tempSTRTOK);
+                    req->command = HTTP_BAD_REQ;
+                    req->status = HTTP_404_NOT_FOUND;
                 }
             }
+
+            /* a bad request leaves the parser out of sync with the client
+             * so close the connection after the error response, and close
+             * it anyway once the connection served its quota of requests
+             */
+            if ( req->command == HTTP_BAD_REQ && req->status != HTTP_404_NOT_FOUND )
+                req->keepAlive = 0;
+            if ( sessions[httpSes].reqCount >= HTTP_MAX_KEEPALIVE_REQ )
+                req->keepAlive = 0;
+
+            sessions[httpSes].respBytes = 0;
             sessions[httpSes].state = SEND_RESP_HEADER;
             break;
 
             /* once the header has been parsed we need to send a response
-             * header. from here we either go to close if the response was an
-             * error report to the client or simply a response to a HEAD request,
-             * otherwise, we go to SEND_RESP state
+             * header. stay here until all of the header was queued with TCP.
+             * from here we are done if the response was an error report to
+             * the client or simply a response to a HEAD request or a
+             * not-modified response, otherwise, we go to SEND_RESP state
              */
             case SEND_RESP_HEADER:
 #if __HTTPD_DEBUG__
@@ -975,14 +1595,28 @@ int http_session_handler(int httpSes)
 #if __HTTPD_DEBUG__
                 printf("  Response header sent (%d)\n", result);
 #endif
-                if ( req->command == HTTP_HEAD ||
-                     req->command == HTTP_BAD_REQ )
+                if ( result == ERR_TCP_CLOSING || result == ERR_TCP_CLOSED )
                 {
                     sessions[httpSes].state = CLOSE;
                 }
+                else if ( sessions[httpSes].respSent < sessions[httpSes].respBytes )
+                {
+                    break;
+                }
+                else if ( req->command == HTTP_HEAD ||
+                          req->command == HTTP_BAD_REQ ||
+                          req->status == HTTP_304_NOT_MODIFIED )
+                {
+                    http_session_done(httpSes);
+                }
                 else
                 {
-                    sessions[httpSes].state = SEND_RESP;
+                    result = tcp_send_from(sessions[httpSes].connection, resource_producer,
+                                           (void*) &sessions[httpSes], (uint32_t) resources[sessions[httpSes].resourceId].fileLen);
+                    if ( result == ERR_OK )
+                        sessions[httpSes].state = SEND_RESP;
+                    else
+                        sessions[httpSes].state = CLOSE;
                 }
                 break;
 
@@ -992,42 +1626,30 @@ int http_session_handler(int httpSes)
              * have been sent in state SEND_RESP_HEADER
              */
             case SEND_RESP:
-                /* read a set of bytes from the file resource into the send buffer
-                 * adjust the read position based on the number of bytes read.
-                 * adjust the read position only if the TCP send is successful.
-                 * determine if end of the resource file was reached and if true
-                 * set the state to CLOSE.
-                 * send the buffer as a TCP segment
+                /* the resource's content is written directly into TCP segments by
+                 * resource_producer() that was registered with tcp_send_from() in
+                 * state SEND_RESP_HEADER. the resource must stay open until TCP
+                 * is done with the producer, so just wait here until then.
+                 * if the resource could not be read to its end the response is shorter
+                 * than its Content-Length, so the connection is closed
                  */
-#if __HTTPD_DEBUG__
-                printf("[s:%d/%d,c:%d] Data send\n", httpSes, activeSessions, sessions[httpSes].connection);
-#endif
-                result = resource_read(sessions[httpSes].resourceId, sessions[httpSes].filePos, sessions[httpSes].data, SESS_BUFF_SIZE);
-#if __HTTPD_DEBUG__
-                printf("  Read:%d", result);
-#endif
-                if ( result > 0 )
-                {
-                    result = tcp_send(sessions[httpSes].connection, sessions[httpSes].data, result, TCP_FLAG_PSH);
-#if __HTTPD_DEBUG__
-                    printf(", Sent:%d", result);
-#endif
-                    if ( result > 0 )
-                    {
-                        sessions[httpSes].filePos += (long) result;
-                    }
-                }
-
-                if ( resource_eof(sessions[httpSes].resourceId, sessions[httpSes].filePos) )
+                result = tcp_send_pending(sessions[httpSes].connection);
+                if ( result < 0 )
                 {
+                    printf("[s:%d/%d,c:%d] Resource read error at %ld\n", httpSes, activeSessions, sessions[httpSes].connection, sessions[httpSes].filePos);
                     sessions[httpSes].state = CLOSE;
                 }
+                else if ( result == 0 )
+                {
 #if __HTTPD_DEBUG__
-                printf("\n");
+                    printf("[s:%d/%d,c:%d] Data sent %ld\n", httpSes, activeSessions, sessions[httpSes].connection, sessions[httpSes].filePos);
 #endif
+                    http_session_done(httpSes);
+                }
                 break;
 
-            /* once header response and page response have been sent
+            /* once header response and page response have been sent on a
+             * non-persistent connection, or a persistent connection is idle,
              * close the resource then the connection. finally reset the
              * session data structure for next session
              */
@@ -32,5 +32,8 @@ void      arp_input(struct pbuf_t* const,                   // link layer packet
 ip4_err_t arp_output(struct net_interface_t* const,         // packet output function with address resolution,
                      struct pbuf_t* const);
 ip4_err_t arp_gratuitous(struct net_interface_t* const);    // send a gratuitous ARP message
+ip4_err_t arp_frame_header(struct net_interface_t* const,   // build a frame header from the ARP table, no request is sent
+                           ip4_addr_t,
+                           struct ethernet_frame_t* const);
 
 #endif /* __ARP_H__ */
@@ -33,7 +33,8 @@ typedef enum                        // stack wide error codes
     ERR_PCB_ALLOC = -17,            // could not allocate/find PCB
     ERR_TCP_CLOSING = -18,          // a command issued to a TCP connection that is in the process of closing
     ERR_TCP_CLOSED  = -19,          // a command issued to a TCP connection that is closed
-    ERR_TCP_WACK  = -20             // TCP is waiting for an ACK, cannot transmit the segment
+    ERR_TCP_WACK  = -20,            // TCP is waiting for an ACK, cannot transmit the segment
+    ERR_TCP_PRODUCER = -21          // the producer of tcp_send_from() failed before it wrote all its data
 } ip4_err_t;
 
 #endif /* __IP4ERROR_H__ */
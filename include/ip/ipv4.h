@@ -20,5 +20,11 @@
 ----------------------------------------- */
 void      ip4_input(struct pbuf_t* const, struct net_interface_t* const);   // input IPv4 packet
 ip4_err_t ip4_output(ip4_addr_t, ip4_protocol_t, struct pbuf_t* const);     // output an IPv4 packet
+struct net_interface_t* ip4_template(ip4_addr_t, ip4_protocol_t,            // build frame and IPv4 header template for packets to a destination
+                                     uint16_t, uint8_t* const);
+ip4_err_t ip4_output_prebuilt(struct net_interface_t* const,                // output an IPv4 packet with headers copied from a template
+                              struct pbuf_t* const);
+uint16_t  ip4_payload_checksum(struct pbuf_t* const);                       // transport checksum of an input packet, 0xffff if valid
+uint32_t  ip4_pseudo_sum(ip4_addr_t, ip4_addr_t, ip4_protocol_t, uint16_t); // TCP or UDP pseudo-header sum
 
 #endif /* __IPV4_H__ */
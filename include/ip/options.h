@@ -94,16 +94,37 @@
 
 #define     DEF_RTT             2000UL      // changes to 2[sec] because of slow CPU (was 1[sec] RFC 6298 section 2.1)
 #define     TCP_MAX_RETRAN      5           // maximum number of TCP segment retransmits before reset and connection abort
+#define     TCP_TIMER_TICK      100UL       // TCP timeout handler interval, the retransmit timer granularity (RFC 6298 'G')
+#define     TCP_MIN_RTO         200UL       // lower bound of retransmit timeout, RFC 6298 1[sec] is too long on a LAN
+#define     TCP_MAX_RTO         60000UL     // upper bound of retransmit timeout and its back-off
+#define     TCP_ACK_DELAY       50UL        // delayed ACK timeout, sent within TCP_ACK_DELAY + TCP_TIMER_TICK, which must be below TCP_MIN_RTO
 
 #define     TCP_SERVER_COUNT    1           // number of listening servers
 #define     TCP_CONN_PER_SRVR   10          // max incoming connections per server
 #define     TCP_CLIENT_COUNT    0           // max outgoing client connections
 #define     TCP_PCB_COUNT       (TCP_CLIENT_COUNT+TCP_SERVER_COUNT*(1+TCP_CONN_PER_SRVR))
-#define     TCP_DATA_BUF_SIZE   1024        // in bytes, max 32,768 bytes in powers of 2: 2, 4, 8, 16, 32, ...
+#define     TCP_PCB_HASH        32          // connection lookup table size, in powers of 2 and at least 2 x TCP_PCB_COUNT
+#define     TCP_DATA_BUF_SIZE   1024        // in bytes, in powers of 2: 2, 4, 8, 16, 32, ..., max 32,768 bytes without TCP_WIN_SCALE
+#define     TCP_BUF_CHUNK       256         // send and receive buffers are made of chunks of this size, in powers of 2 up to TCP_DATA_BUF_SIZE
+#define     TCP_BUF_CHUNKS      40          // buffer chunks shared by all connections, a connection holds up to TCP_DATA_BUF_SIZE bytes of chunks per buffer
+#define     TCP_BUF_RESERVE     8           // free buffer chunks kept for receiving text in order, send buffers and out-of-order text can't take them
 #define     TCP_DEF_WINDOW      TCP_DATA_BUF_SIZE   // bytes
+#define     TCP_SUM_HINTS       4           // precomputed payload checksums remembered per connection, see tcp_send_sum()
+#define     TCP_MAX_INFLIGHT    4           // max segments sent and not acknowledged per connection (retransmit queue length)
+#define     TCP_RTQ_BUFS        4           // max TX_BUFS held by all retransmit queues together, leave some for ACK and other output
+#define     TCP_CONGESTION_CTRL 1           // '1' slow start, congestion avoidance and NewReno loss recovery, '0' send up to the peer's window
+#define     TCP_OOQ_SPANS       4           // out-of-order data ranges held in the receive buffer per connection, '0' drops out-of-order segments
+#define     TCP_WIN_SCALE       0           // '1' negotiate window scaling (RFC 7323) and use 32-bit windows, for buffers of 64KB and more with 32-bit int
+#define     TCP_SACK            1           // '1' negotiate selective acknowledgment (RFC 2018), SACK blocks are sent for TCP_OOQ_SPANS ranges
+#define     TCP_HDR_TEMPLATE    1           // '1' build each connection's frame, IP and TCP headers once and patch them per segment
+#define     TCP_HDR_PREDICT     1           // '1' process in-order ACK and data segments of ESTABLISHED connections on a fast path
+#define     TCP_DELAYED_ACK     1           // '1' delay the ACK of received text to send it with data or with the next segment's ACK
+#define     TCP_NAGLE           1           // '1' hold small segments to send full ones (RFC 1122 4.2.3.4), unless tcp_nodelay() is set
+#define     TCP_RCV_SWS         1           // '1' open the receive window in large steps only and send window updates (RFC 1122 4.2.3.3)
 
 #define     TCP_MSL_TIMEOUT     30000UL     // Maximum Segment Lifetime (in RFC-793 = 2 minutes)
 #define     TCP_HSTATE_TIMEOUT  120000UL    // time out to exit a half open or half closed state (typical = 5min)
+#define     TCP_TW_COUNT        16          // connections held in TIME-WAIT without a PCB, '0' keeps the PCB in TIME-WAIT
 
 /*
  * general debug options
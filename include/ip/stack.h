@@ -41,6 +41,8 @@ void                            pbuf_free(struct pbuf_t* const);
 uint16_t                        stack_ntoh(uint16_t);                                   // big-endian to little-endian 16bit bytes swap
 uint32_t                        stack_ntohl(uint32_t);                                  // big-endian to little-endian 32bit bytes swap
 uint16_t                        stack_checksumEx(const void*, int, uint32_t);           // checksum calculation
+uint16_t                        stack_copy_checksum(void*, const void*, int, uint32_t); // copy and checksum calculation in one pass
+uint16_t                        stack_checksum_update(uint16_t, uint16_t, uint16_t);    // incremental checksum update of a changed 16bit field
 char*                           stack_ip4addr_ntoa(ip4_addr_t, char* const, uint8_t);   // convert network address to string representation
 
 void                            inputStub(struct pbuf_t* const,                         // input stub function
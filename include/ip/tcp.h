@@ -59,7 +59,20 @@ int               tcp_is_connected(pcbid_t);            // to poll if a tcp_conn
 int               tcp_send(pcbid_t,                     // send data from a buffer, returns byte count actually sent
                            uint8_t* const,              // application/user source buffer
                            uint16_t,                    // byte count to send
-                           uint16_t);                   // flags: 0 or TCP_FLAG_PSH or TCP_FLAG_URG (TCP_FLAG_URG not implemented)
+                           uint16_t);                   // flags: 0 if more data follows or TCP_FLAG_PSH, TCP_FLAG_URG not implemented
+int               tcp_send_sum(pcbid_t,                 // send data with its precomputed checksum, all bytes or none are sent
+                               uint8_t* const,          // application/user source buffer
+                               uint16_t,                // byte count to send
+                               uint16_t,                // flags: 0 or TCP_FLAG_PSH
+                               uint16_t);               // checksum of the data as returned by stack_checksum()
+ip4_err_t         tcp_send_from(pcbid_t,                // send data that a producer call-back writes directly into segments
+                                tcp_producer_fn,        // producer call-back
+                                void*,                  // producer context
+                                uint32_t);              // byte count to send
+int               tcp_send_pending(pcbid_t);            // '1' while data from tcp_send_from() waits to be sent, ERR_TCP_PRODUCER if it failed
+ip4_err_t         tcp_flush(pcbid_t);                   // push the data queued with tcp_send(), send it without waiting for more data
+ip4_err_t         tcp_nodelay(pcbid_t,                  // set '1' to send small segments without delay, '0' for the default
+                              int);                     // coalescing of small sends (Nagle)
 int               tcp_recv(pcbid_t,                     // received data, returns byte counts read into application/user buffer
                            uint8_t* const,              // application/user receive buffer
                            uint16_t);                   // byte count available in receive buffer
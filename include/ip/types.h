@@ -221,6 +221,11 @@ typedef void (*udp_recv_callback)(struct pbuf_t* const,         // UDP data rece
                                   const uint16_t);              // and source port
 
 typedef int     pcbid_t;                                        // PCB identifier
+#if TCP_WIN_SCALE
+typedef uint32_t tcp_win_t;                                     // TCP window and buffer index, windows are scaled beyond 64KB
+#else
+typedef uint16_t tcp_win_t;
+#endif
 
 struct udp_pcb_t
 {
@@ -271,13 +276,51 @@ typedef enum                                                    // enumeration o
 
 typedef void (*tcp_accept_callback)(pcbid_t);                   // TCP server accept connection callback function
 typedef void (*tcp_notify_callback)(pcbid_t, tcp_event_t);      // event notification via callback function
+typedef int  (*tcp_producer_fn)(void*, uint32_t, uint8_t*,      // send data producer: context, data offset, destination, max byte count,
+                                uint16_t, uint16_t*);           // optional checksum output. returns byte count written to destination, '0' or less if failed
+
+struct tcp_rtq_t                                                // retransmit queue entry
+{
+    struct pbuf_t      *pbuf;                                   // queued segment
+    uint32_t            seq;                                    // sequence number of the segment
+    uint16_t            len;                                    // sequence space the segment takes, includes SYN and FIN
+    uint16_t            bufLen;                                 // data bytes that came from the send buffer
+    uint32_t            sendTime;                               // time stamp of first transmission, '0' after retransmission
+#if TCP_SACK
+    uint8_t             sacked;                                 // segment was selectively acknowledged
+#endif
+};
+
+struct tcp_span_t                                               // range of sequence space
+{
+    uint32_t            left;                                   // first sequence number
+    uint32_t            right;                                  // sequence number following the last
+};
+
+struct tcp_sum_hint_t                                           // precomputed checksum of a range of the send stream
+{
+    uint32_t            seq;                                    // sequence number of first byte in range
+    uint16_t            len;                                    // range length, '0' if hint is not used
+    uint16_t            sum;                                    // non-inverted one's complement sum of the range
+};
+
+#define     TCP_BUF_SLOTS       (TCP_DATA_BUF_SIZE / TCP_BUF_CHUNK) // chunk slots of a send or receive buffer
+#define     TCP_SACK_BLOCKS     3                               // SACK blocks that fit in the options with a time stamp
+#define     TCP_WSCALE_NONE     255                             // no window scale option
+#define     TCP_WSCALE_MAX      14                              // largest window scale shift (RFC 7323)
+#define     TCP_TMPL_LEN        54                              // Ethernet, IPv4 and TCP headers of a segment, without options
 
 struct tcp_opt_t                                                // supported TCP options
 {
     uint16_t            mss;                                    // max segment size
-    uint8_t             winScale;                               // window scale
+    uint8_t             winScale;                               // window scale, TCP_WSCALE_NONE if the option was not received
     uint32_t            time;                                   // time stamp sent or to echo
     uint32_t            echoTime;                               // time stamp echo
+#if TCP_SACK
+    uint8_t             sackOk;                                 // SACK permitted option received
+    uint8_t             sackCount;                              // SACK blocks received in the last segment
+    struct tcp_span_t   sack[TCP_SACK_BLOCKS];                  // SACK blocks
+#endif
 };
 
 struct tcp_pcb_t
@@ -295,7 +338,7 @@ struct tcp_pcb_t
      */
     uint32_t            SND_UNA;                                // send unacknowledged
     uint32_t            SND_NXT;                                // send next
-    uint16_t            SND_WND;                                // send window
+    tcp_win_t           SND_WND;                                // send window
     uint16_t            SND_UP;                                 // send urgent pointer
     uint32_t            SND_WL1;                                // segment sequence number used for last window update
     uint32_t            SND_WL2;                                // segment acknowledgment number used for last window update
@@ -308,33 +351,81 @@ struct tcp_pcb_t
     uint32_t            SEG_SEQ;                                // segment sequence number
     uint32_t            SEG_ACK;                                // segment acknowledgment number
     uint16_t            SEG_LEN;                                // segment length
-    uint16_t            SEG_WND;                                // segment window
+    tcp_win_t           SEG_WND;                                // segment window, scaled
     uint16_t            SEG_UP;                                 // segment urgent pointer
 
     uint32_t            RCV_NXT;                                // receive next
-    uint16_t            RCV_WND;                                // receive window
+    tcp_win_t           RCV_WND;                                // receive window
     uint16_t            RCV_UP;                                 // receive urgent pointer
     uint32_t            IRS;                                    // initial receive sequence number
     struct tcp_opt_t    RCV_opt;                                // TCP options
+#if TCP_WIN_SCALE
+    uint8_t             sndShift;                               // peer's window scale, applied to received windows
+    uint8_t             rcvShift;                               // our window scale, applied to sent windows
+#endif
 
     /* send and receive buffers
      */
-    uint8_t            *send;                                   // pointer to circular send buffer
-    uint16_t            sendWRp;                                // write index to circular buffer
-    uint16_t            sendRDp;                                // read index from circular buffer
+    uint8_t            *send[TCP_BUF_SLOTS];                    // chunks of circular send buffer, NULL if a chunk is not held
+    tcp_win_t           sendWRp;                                // write index to circular buffer
+    tcp_win_t           sendRDp;                                // read index from circular buffer
     int                 sendCnt;                                // bytes available in buffer
-    uint16_t            sendLen;                                // data/text length of last segment send
-    uint32_t            sendTime;                               // segment retransmit time reference
-    uint32_t            resendTime;                             // last retransmit time
+    tcp_win_t           sendInFlight;                           // bytes of send buffer that were sent and are not acknowledged
+    uint32_t            resendTime;                             // retransmit timer start time
     uint8_t             retranCnt;                              // retransmit count
+    uint32_t            persistTime;                            // persist timer start time, or time of the last window probe
+    uint8_t             persistCnt;                             // window probe back-off count + 1, '0' if the persist timer is off
     uint32_t            RT0;                                    // current retransmit time
-    uint32_t            SRTT;                                   // smoothed round-trip time
-    uint32_t            RTTVAR;                                 // round-trip time variation
-    struct pbuf_t      *pbufQ;                                  // pbuf retransmit queue
-    uint8_t            *recv;                                   // pointer to circular receive buffer
-    uint16_t            recvWRp;
-    uint16_t            recvRDp;
+    uint32_t            SRTT;                                   // smoothed round-trip time x8, '0' if not measured
+    uint32_t            RTTVAR;                                 // round-trip time variation x4
+    struct tcp_rtq_t    rtq[TCP_MAX_INFLIGHT];                  // retransmit queue of segments waiting for an ACK
+    uint8_t             rtqHead;                                // oldest segment in retransmit queue
+    uint8_t             rtqCount;                               // segments in retransmit queue
+    uint8_t             dupAcks;                                // duplicate ACK count, in fast recovery if at least DUPACK_THRESH
+#if TCP_CONGESTION_CTRL
+    uint32_t            cwnd;                                   // congestion window
+    uint32_t            ssthresh;                               // slow start threshold
+    uint32_t            recover;                                // SND.NXT when loss recovery started (RFC 6582)
+#endif
+    struct tcp_sum_hint_t sumHint[TCP_SUM_HINTS];               // precomputed checksums of data in send buffer
+    uint8_t             sumHintWr;                              // next hint to overwrite
+    tcp_producer_fn     producer;                               // producer of data to send after the send buffer, NULL if none
+    void               *producerCtx;                            // producer's context
+    uint32_t            prodLen;                                // byte count to send from the producer
+    uint32_t            prodOffset;                             // offset of next byte to produce
+    uint8_t             prodFailed;                             // the producer failed before it wrote prodLen bytes
+    uint8_t            *recv[TCP_BUF_SLOTS];                    // chunks of circular receive buffer, NULL if a chunk is not held
+    tcp_win_t           recvWRp;
+    tcp_win_t           recvRDp;
     int                 recvCnt;
+#if TCP_OOQ_SPANS
+    struct tcp_span_t   ooq[TCP_OOQ_SPANS];                     // out-of-order data in the receive buffer beyond RCV.NXT, sorted
+    uint8_t             ooqCount;                               // out-of-order data ranges
+#if TCP_SACK
+    uint32_t            ooqRecent;                              // sequence number of the last out-of-order segment, reported first
+#endif
+#endif
+#if TCP_SACK
+    uint8_t             sackOk;                                 // both sides permitted SACK
+#endif
+#if TCP_DELAYED_ACK
+    uint8_t             ackPending;                             // received text is not acknowledged
+    uint32_t            ackTime;                                // time the text that was not acknowledged arrived
+#endif
+    uint32_t            rcvAdv;                                 // right edge of the receive window last advertised
+#if TCP_NAGLE
+    uint8_t             noDelay;                                // send small segments without delay, set with tcp_nodelay()
+    uint32_t            pushEnd;                                // sequence number after the last byte pushed
+    uint32_t            smallEnd;                               // sequence number after the last segment smaller than SMSS
+#endif
+
+#if TCP_HDR_TEMPLATE
+    /* prebuilt headers of the connection's segments
+     */
+    struct net_interface_t *tmplNetif;                          // interface the template was built for, NULL if there is no template
+    uint32_t            tmplSum;                                // sum of the pseudo-header without the length, and of the template's TCP header
+    uint8_t             tmpl[TCP_TMPL_LEN];                     // frame, IP and TCP headers without options
+#endif
 
     /* call back functions for notification
      * functionality
@@ -343,15 +434,31 @@ struct tcp_pcb_t
     tcp_notify_callback tcp_notify_fn;                          // optional event notification callback pointer
 };
 
+struct tcp_tw_t                                                 // connection in TIME-WAIT, its PCB is freed
+{
+    ip4_addr_t          localIP;                                // local IP address
+    uint16_t            localPort;                              // local port, '0' if the entry is not used
+    ip4_addr_t          remoteIP;                               // remote IP address
+    uint16_t            remotePort;                             // remote port
+    uint32_t            SND_NXT;                                // sequence number following our FIN
+    uint32_t            RCV_NXT;                                // sequence number following the remote FIN
+    uint32_t            timeInState;                            // time stamp on state entry, or of the last remote FIN
+};
+
 /* -----------------------------------------
    Packet buffer
 ----------------------------------------- */
 #define     PBUF_FREE               0                           // packet buffer is free to use
 #define     PBUF_MARKED            -1                           // packet buffer is in use, but not populated with data
 
+#define     PBUF_FLAG_NONE          0x00
+#define     PBUF_FLAG_SUM           0x01                        // 'sum' holds the sum of the IP packet accumulated by the link driver
+
 struct pbuf_t
 {
     int         len;                                            // bytes count in buffer, == 0 is puffer is free
+    uint8_t     flags;                                          // PBUF_FLAG_*
+    uint16_t    sum;                                            // folded one's complement sum of the bytes from the IP header to 'len'
     uint8_t     pbuf[PACKET_BUF_SIZE];                          // packet buffer data bytes
 };
 
@@ -25,6 +25,7 @@ static ip4_err_t arp_queue(ip4_addr_t, struct net_interface_t* const, struct pbu
 static void      arp_unqueue(void);
 static void      arp_queue_clr(uint32_t);
 static void      arp_cache_clr(uint32_t);
+static ip4_addr_t arp_next_hop(struct net_interface_t* const, ip4_addr_t);
 
 /* -----------------------------------------
    globals
@@ -264,20 +265,7 @@ ip4_err_t arp_output(struct net_interface_t* const netif, struct pbuf_t* const p
     frame = (struct ethernet_frame_t*) p->pbuf;                     // establish pointer to ethernet frame
     ipHeader = (struct ip_header_t*) &(frame->payloadStart);        // establish pointer to IP header
 
-    /* extract destination IP and check if it is in this
-     * interface's subnet. if it is not, then send the packet
-     * to the gateway (ARP for the gateway's address if needed)
-     * otherwise resolve the target address and send as usual
-     */
-    if ( (ipHeader->destIp & netif->subnet) == netif->network )     // check network association
-    {
-        destIp = ipHeader->destIp;                                  // use destination IP as is
-    }
-    else
-    {
-        destIp = netif->gateway;                                    // this packet needs to go to the router/gateway
-    }
-
+    destIp = arp_next_hop(netif, ipHeader->destIp);                 // the destination or the gateway
     hwaddr = arp_query(netif, destIp);                              // resolve HW address
     if ( hwaddr )                                                   // was an entry found in the table?
     {                                                               // yes:
@@ -304,6 +292,34 @@ ip4_err_t arp_output(struct net_interface_t* const netif, struct pbuf_t* const p
     return result;
 }
 
+/* -----------------------------------------
+ * arp_frame_header()
+ *
+ * This function builds the Ethernet frame header of a packet
+ * to an IP destination from the ARP table, without sending an ARP request
+ * or queuing the packet if the address is not resolved.
+ * It is used to build header templates that are reused for many packets.
+ *
+ * param:  netif the network interface, destination IP and
+ *         pointer to the frame header to build
+ * return: ERR_OK if the HW address was resolved, otherwise ERR_ARP_NONE
+ *
+ */
+ip4_err_t arp_frame_header(struct net_interface_t* const netif, ip4_addr_t destIp, struct ethernet_frame_t* const frame)
+{
+    hwaddr_t                *hwaddr;
+
+    hwaddr = arp_query(netif, arp_next_hop(netif, destIp));
+    if ( hwaddr == NULL )
+        return ERR_ARP_NONE;
+
+    copy_hwaddr(frame->src, netif->hwaddr);
+    copy_hwaddr(frame->dest, hwaddr);
+    frame->type = stack_ntoh(TYPE_IPV4);
+
+    return ERR_OK;
+}
+
 /* -----------------------------------------
  * arp_gratuitous()
  *
@@ -539,3 +555,22 @@ static void arp_cache_clr(uint32_t now)
         }
     }
 }
+
+/* -----------------------------------------
+ * arp_next_hop()
+ *
+ * check if a destination IP is in this interface's subnet.
+ * if it is not, then the packet goes to the gateway
+ * (ARP for the gateway's address if needed)
+ *
+ * param:  netif the network interface and destination IP
+ * return: IP address to resolve, destination or gateway
+ *
+ */
+static ip4_addr_t arp_next_hop(struct net_interface_t* const netif, ip4_addr_t destIp)
+{
+    if ( (destIp & netif->subnet) == netif->network )               // check network association
+        return destIp;                                              // use destination IP as is
+
+    return netif->gateway;                                          // this packet needs to go to the router/gateway
+}
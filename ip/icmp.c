@@ -54,6 +54,7 @@ ip4_err_t icmp_ping_output(ip4_addr_t dest, uint16_t ident, uint16_t seq, uint8_
     ip4_err_t       result = ERR_OK;
     struct pbuf_t  *p;
     struct icmp_t  *icmp_out;
+    uint16_t        sum;
 
     p = pbuf_allocate();
     if ( p != NULL )
@@ -64,8 +65,8 @@ ip4_err_t icmp_ping_output(ip4_addr_t dest, uint16_t ident, uint16_t seq, uint8_
         icmp_out->checksum = 0;                                                     // replace after calculating
         icmp_out->id = stack_ntoh(ident);
         icmp_out->seq = stack_ntoh(seq);
-        memcpy(&(icmp_out->payloadStart), payload, payloadLen);                     // copy payload
-        icmp_out->checksum = ~(stack_checksum(icmp_out, ICMP_HDR_LEN + payloadLen));// calculate ICMP checksum
+        sum = stack_copy_checksum(&(icmp_out->payloadStart), payload, payloadLen, 0UL); // copy payload and sum it in one pass
+        icmp_out->checksum = ~(stack_checksumEx(icmp_out, ICMP_HDR_LEN, stack_ntoh(sum))); // calculate ICMP checksum
 
         p->len = FRAME_HDR_LEN + IP_HDR_LEN + ICMP_HDR_LEN + payloadLen;            // set packet length
 
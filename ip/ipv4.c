@@ -26,6 +26,8 @@ extern struct ip4stack_t   stack;                                  // IP stack d
    static functions
 ----------------------------------------- */
 static void ip4_icmp_handler(struct pbuf_t* const, struct net_interface_t* const);
+static struct net_interface_t* route_netif(ip4_addr_t);
+static void build_header(struct ip_header_t* const, ip4_addr_t, ip4_addr_t, ip4_protocol_t, uint16_t);
 
 /*------------------------------------------------
  * ip4_input()
@@ -96,6 +98,71 @@ void ip4_input(struct pbuf_t* const p, struct net_interface_t* const netif)
     }
 }
 
+/*------------------------------------------------
+ * ip4_pseudo_sum()
+ *
+ *  calculate the sum of a TCP or UDP pseudo-header.
+ *  the output is only useful as input to stack_checksumEx()
+ *
+ * param:  source and destination IP, protocol, length of the TCP segment or UDP datagram
+ * return: 32bit accumulated sum of pseudo-header bytes
+ *
+ */
+uint32_t ip4_pseudo_sum(ip4_addr_t source, ip4_addr_t dest, ip4_protocol_t protocol, uint16_t len)
+{
+    uint32_t                acc;
+
+    /* the addresses are in network order, so each 16-bit half
+     * is swapped to the network order word value it is summed as
+     */
+    acc  = stack_ntoh((uint16_t) source);
+    acc += stack_ntoh((uint16_t)(source >> 16));
+    acc += stack_ntoh((uint16_t) dest);
+    acc += stack_ntoh((uint16_t)(dest >> 16));
+    acc += (uint8_t) protocol;                                                  // zero byte and protocol
+    acc += len;
+
+    return acc;
+}
+
+/*------------------------------------------------
+ * ip4_payload_checksum()
+ *
+ *  calculate the TCP or UDP checksum of an input packet, over the pseudo-header
+ *  and the IP payload. if the link driver accumulated the packet's sum while
+ *  copying it into the pbuf, the payload is not read again: ip4_input() validated
+ *  the IP header, and a valid header sums to 0xffff (negative zero), so the packet's
+ *  sum is also the sum of its payload.
+ *  a packet shorter than its IP header's length field fails the test.
+ *
+ * param:  pointer to an input pbuf that passed ip4_input()
+ * return: non-inverted Internet sum, 0xffff if the checksum is valid
+ *
+ */
+uint16_t ip4_payload_checksum(struct pbuf_t* const p)
+{
+    struct ip_header_t *ip;
+    uint32_t            acc;
+    int                 ipHeaderLen, ipLen, payloadLen, packetLen;
+
+    ip = (struct ip_header_t*) &(p->pbuf[FRAME_HDR_LEN]);
+    ipHeaderLen = (ip->verHeaderLength & 0x0f) * 4;
+    ipLen = stack_ntoh(ip->length);
+    payloadLen = ipLen - ipHeaderLen;
+    packetLen = p->len - (int) FRAME_HDR_LEN;                                   // signed, so a short pbuf does not wrap
+
+    if ( ipLen > packetLen || payloadLen < 0 )
+        return 0;
+
+    acc = ip4_pseudo_sum(ip->srcIp, ip->destIp, ip->protocol, (uint16_t) payloadLen);
+
+    if ( (p->flags & PBUF_FLAG_SUM) &&
+         ipLen == packetLen )                                    // Ethernet padding is not part of the packet
+        return stack_checksumEx(NULL, 0, acc + p->sum);
+
+    return stack_checksumEx(((uint8_t*) ip) + ipHeaderLen, payloadLen, acc);
+}
+
 /*------------------------------------------------
  * ip4_output()
  *
@@ -116,80 +183,146 @@ ip4_err_t ip4_output(ip4_addr_t dest, ip4_protocol_t protocol, struct pbuf_t* co
 {
     ip4_err_t               result = ERR_OK;
     struct net_interface_t *netif;
-    struct ip_header_t     *ipHeader;
-    struct route_tbl_t     *route;
-    uint8_t                 i;
 
     if ( p->len > (FRAME_HDR_LEN + MTU + PACKET_CRC_LEN) )                      // TODO drop packets that are larger than MTU, no fragmentation support
         return ERR_MTU_EXD;
 
-    ipHeader = (struct ip_header_t*) &(p->pbuf[FRAME_HDR_LEN]);
-
-    /* build the IP header and populate it with the common fields
-     */
-    ipHeader->verHeaderLength = IP_VER + IP_IHL;
-    ipHeader->qos = IP_QOS;
-    ipHeader->length = stack_ntoh((p->len - FRAME_HDR_LEN));
-    ipHeader->id = 0;                                                           // TODO need a proper ID schema
-    ipHeader->defrag = stack_ntoh(0 | IP_FLAG_DF);
-    ipHeader->ttl = IP_TTL;
-    ipHeader->protocol = protocol;
-    ipHeader->checksum = 0;                                                     // replace after calculating
-    ipHeader->destIp = dest;                                                    // destination IP
-
     /* TODO if we need to insert options, then the datagram or segment data
      *    will have to be moved. right now implementation assumes no IPv4 options
      *    are needed (IHL = 5).
      */
 
-    /* find an interface by scanning the route table for a valid network
-     * that connects to 'dest', if no route found drop packet and return error
+    netif = route_netif(dest);
+    if ( netif == NULL )
+        return ERR_NETIF;                                                       // could not get network interface assigned
+
+    /* build the IP header and send the packet
      */
+    build_header((struct ip_header_t*) &(p->pbuf[FRAME_HDR_LEN]), netif->ip4addr, dest, protocol, p->len - FRAME_HDR_LEN);
+    if ( netif->output )
+        result = netif->output(netif, p);                                       // send the packet
+
+    return result;
+}
+
+/*------------------------------------------------
+ * ip4_template()
+ *
+ *  build the frame and IPv4 headers of packets to a destination, to be
+ *  copied to the top of packets and sent with ip4_output_prebuilt().
+ *  the route is selected, and on an Ethernet interface the destination's
+ *  HW address resolved, once for all the packets that use the template.
+ *  the template is not built if the HW address is not in the ARP table.
+ *
+ * param:  destination IP, protocol type, packet length without the frame header,
+ *         pointer to FRAME_HDR_LEN + IP_HDR_LEN bytes of template
+ * return: network interface to send the packets through, NULL if the template was not built
+ *
+ */
+struct net_interface_t* ip4_template(ip4_addr_t dest, ip4_protocol_t protocol, uint16_t len, uint8_t* const hdr)
+{
+    struct net_interface_t *netif;
+
+    netif = route_netif(dest);
+    if ( netif == NULL )
+        return NULL;
+
+    if ( netif->output == arp_output &&                                         // resolve now, and not per packet in arp_output()
+         arp_frame_header(netif, dest, (struct ethernet_frame_t*) hdr) != ERR_OK )
+        return NULL;
+
+    build_header((struct ip_header_t*) &(hdr[FRAME_HDR_LEN]), netif->ip4addr, dest, protocol, len);
+
+    return netif;
+}
+
+/*------------------------------------------------
+ * ip4_output_prebuilt()
+ *
+ *  output an IPv4 packet whose frame and IP headers were copied from a
+ *  template built by ip4_template(). only the packet length is patched, and the
+ *  header checksum is updated incrementally (RFC 1624) instead of calculated again.
+ *  no route or HW address lookup is done.
+ *
+ * param:  network interface returned by ip4_template(), pointer to output pbuf
+ * return: ERR_OK if send was successful, ip4_err_t on error
+ *
+ */
+ip4_err_t ip4_output_prebuilt(struct net_interface_t* const netif, struct pbuf_t* const p)
+{
+    struct ip_header_t     *ipHeader;
+    uint16_t                length;
+
+    if ( p->len > (int) (FRAME_HDR_LEN + MTU + PACKET_CRC_LEN) )
+        return ERR_MTU_EXD;
+
+    ipHeader = (struct ip_header_t*) &(p->pbuf[FRAME_HDR_LEN]);
+    length = stack_hton(p->len - FRAME_HDR_LEN);
+    ipHeader->checksum = stack_checksum_update(ipHeader->checksum, ipHeader->length, length);
+    ipHeader->length = length;
+
+    if ( netif->output == arp_output )                                          // the frame header is already resolved
+    {
+        if ( (netif->flags & (NETIF_FLAG_UP + NETIF_FLAG_LINK_UP)) && netif->linkoutput )
+            return netif->linkoutput(netif, p);
+        return ERR_NETIF;
+    }
+
+    if ( netif->output )
+        return netif->output(netif, p);
+
+    return ERR_OK;
+}
+
+/*------------------------------------------------
+ * route_netif()
+ *
+ *  find an interface by scanning the route table for a valid network
+ *  that connects to 'dest'. if a route was not found, select the
+ *  default gateway of the first interface
+ *
+ * param:  destination IP
+ * return: pointer to network interface, NULL if none is assigned
+ *
+ */
+static struct net_interface_t* route_netif(ip4_addr_t dest)
+{
+    struct route_tbl_t     *route;
+    uint8_t                 i;
+
     for (i = 0; i < ROUTE_TABLE_LENGTH; i++)
     {
         route = stack_get_route(i);                                             // get pointer to route record
         if ( route != NULL && (route->destNet == (dest & route->netMask)) )     // check if valid route on this network
-        {
-            netif = stack_get_ethif(route->netIf);                              // get pointer to the target interface
-            if ( netif != NULL )
-            {
-                ipHeader->srcIp = netif->ip4addr;
-                ipHeader->checksum = ~(stack_checksum(ipHeader, IP_HDR_LEN));   // calculate IP header checksum
-                if ( netif->output )
-                    result = netif->output(netif, p);                           // send the packet
-            }
-            else
-            {
-                result = ERR_NETIF;                                             // could not get network interface assigned
-            }
-            break;                                                              // abort the search
-        }
-        else
-        {
-            result = ERR_NO_ROUTE;
-        }
-    } /* end of route-table search loop */
-
-    /* if a route was not found, select the default gateway
-     * of the first interface
-     */
-    if ( result == ERR_NO_ROUTE )
-    {
-        netif = stack_get_ethif(0);                                             // TODO is this arbitrary selection a good choice?
-        if ( netif != NULL )
-        {
-            ipHeader->srcIp = netif->ip4addr;
-            ipHeader->checksum = ~(stack_checksum(ipHeader, IP_HDR_LEN));       // calculate IP header checksum
-            if ( netif->output )
-                result = netif->output(netif, p);                               // send the packet
-        }
-        else
-        {
-            result = ERR_NETIF;                                                 // could not get network interface assigned
-        }
+            return stack_get_ethif(route->netIf);                               // get pointer to the target interface
     }
 
-    return result;
+    return stack_get_ethif(0);                                                  // TODO is this arbitrary selection a good choice?
+}
+
+/*------------------------------------------------
+ * build_header()
+ *
+ *  populate an IPv4 header with the common fields and calculate its checksum
+ *
+ * param:  pointer to IP header, source and destination IP, protocol type,
+ *         packet length without the frame header
+ * return: none
+ *
+ */
+static void build_header(struct ip_header_t* const ipHeader, ip4_addr_t src, ip4_addr_t dest, ip4_protocol_t protocol, uint16_t len)
+{
+    ipHeader->verHeaderLength = IP_VER + IP_IHL;
+    ipHeader->qos = IP_QOS;
+    ipHeader->length = stack_ntoh(len);
+    ipHeader->id = 0;                                                           // TODO need a proper ID schema
+    ipHeader->defrag = stack_ntoh(0 | IP_FLAG_DF);
+    ipHeader->ttl = IP_TTL;
+    ipHeader->protocol = protocol;
+    ipHeader->checksum = 0;                                                     // replace after calculating
+    ipHeader->srcIp = src;
+    ipHeader->destIp = dest;                                                    // destination IP
+    ipHeader->checksum = ~(stack_checksum(ipHeader, IP_HDR_LEN));               // calculate IP header checksum
 }
 
 /*------------------------------------------------
@@ -212,13 +345,18 @@ static void ip4_icmp_handler(struct pbuf_t* const p, struct net_interface_t* con
     struct pbuf_t       *q;
     uint16_t             ipHeaderLen;
     uint16_t             payloadLen;
+    uint16_t             sum;
 
     ip_in = (struct ip_header_t*) &(((struct ethernet_frame_t*)(p->pbuf))->payloadStart); // pointer to IP packet header
 
     ipHeaderLen = (ip_in->verHeaderLength & 0x0f) * 4;                          // calculate header length in bytes
     icmp_in = (struct icmp_t*)(((uint8_t*) ip_in) + ipHeaderLen);               // pointer to the ICMP header
 
-    payloadLen = p->len - FRAME_HDR_LEN - ipHeaderLen - ICMP_HDR_LEN;           // calculate ICMP payload length in bytes
+    if ( stack_ntoh(ip_in->length) > (p->len - FRAME_HDR_LEN) ||               // drop truncated packets
+         stack_ntoh(ip_in->length) < (ipHeaderLen + ICMP_HDR_LEN) )
+        return;
+
+    payloadLen = stack_ntoh(ip_in->length) - ipHeaderLen - ICMP_HDR_LEN;       // calculate ICMP payload length in bytes, without Ethernet padding
 
     switch ( stack_ntoh(icmp_in->type_code) )
     {
@@ -245,12 +383,12 @@ static void ip4_icmp_handler(struct pbuf_t* const p, struct net_interface_t* con
             icmp_out->id = icmp_in->id;
             icmp_out->seq = icmp_in->seq;
 
-            memcpy(&(icmp_out->payloadStart),
-                   &(icmp_in->payloadStart),
-                   payloadLen);                                                 // copy payload
+            sum = stack_copy_checksum(&(icmp_out->payloadStart),
+                                      &(icmp_in->payloadStart),
+                                      payloadLen, 0UL);                         // copy payload and sum it in one pass
 
             ip_out->checksum = ~(stack_checksum(ip_out, IP_HDR_LEN));           // calculate checksums
-            icmp_out->checksum = ~(stack_checksum(icmp_out, ICMP_HDR_LEN + payloadLen));
+            icmp_out->checksum = ~(stack_checksumEx(icmp_out, ICMP_HDR_LEN, stack_ntoh(sum)));
 
             q->len = FRAME_HDR_LEN + IP_HDR_LEN + ICMP_HDR_LEN + payloadLen;    // set packet length
 
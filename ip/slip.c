@@ -281,6 +281,8 @@ struct pbuf_t* const slip_input(struct net_interface_t* const netif)
     struct pbuf_t  *p;
     uint16_t        len;
     uint16_t        i;
+    uint16_t        sum, word;
+    uint8_t         octet;
     struct slip_t  *slip_priv;
 
     if ( recvPacketCnt == 0 )
@@ -357,13 +359,24 @@ struct pbuf_t* const slip_input(struct net_interface_t* const netif)
     {
         /* read the waiting packet into the pbuf buffer and set buffer length.
          * this is an IP packet! so offset it after the Ethernet frame header
+         * SLIP has no frame CRC, so accumulate the packet's one's complement sum
+         * while copying, and TCP/UDP verify their checksum without reading the payload again
          */
+        sum = 0;
         for ( i = 0; i < len; i++ )
         {
-            p->pbuf[FRAME_HDR_LEN + i] = recvBuffer[recvRdPtr++];
+            octet = recvBuffer[recvRdPtr++];
             recvRdPtr &= CIRC_BUFF_MASK;
+            p->pbuf[FRAME_HDR_LEN + i] = octet;
+
+            word = (i & 1) ? (uint16_t)octet : ((uint16_t)octet << 8);     // network order, even offsets are the high byte
+            sum += word;
+            if ( sum < word )                                               // end-around carry
+                sum++;
         }
         p->len = len + FRAME_HDR_LEN;
+        p->sum = sum;
+        p->flags |= PBUF_FLAG_SUM;
     }
 #ifdef DRV_DEBUG_FUNC_PARAM
     else
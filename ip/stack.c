@@ -300,6 +300,7 @@ struct pbuf_t* const pbuf_allocate(void)
         if ( pBuf[i].len == PBUF_FREE )             // if slot is free
         {
             pBuf[i].len = PBUF_MARKED;              // mark as in use
+            pBuf[i].flags = PBUF_FLAG_NONE;         // no packet sum from the link driver yet
             p = &(pBuf[i]);                         // get pbuf pointer for return
             break;                                  // exit loop
         }
@@ -364,59 +365,266 @@ uint32_t stack_ntohl(uint32_t dw)
     return temp;
 }
 
+/*------------------------------------------------
+ * sum_words()
+ *
+ *  one's complement sum of 16-bit words, in host (little-endian) order.
+ *  on the V25 the words are added with an 'adc' chain that is unrolled
+ *  four words at a time, and the carry is only folded once at the end.
+ *  elsewhere the C version accumulates into 32 bits and folds at the end.
+ *
+ * param:  pointer to the words at any boundary, word count, 16-bit sum to add to
+ * return: folded 16-bit sum
+ *
+ */
+#ifdef __WATCOMC__
+static uint16_t sum_words(const void *wordptr, uint16_t words, uint16_t sum);
+#pragma aux sum_words =                 \
+    "        mov   bx, cx           "   \
+    "        and   bx, 3            "   \
+    "        shr   cx, 1            "   \
+    "        shr   cx, 1            "   \
+    "        clc                    "   \
+    "        jcxz  L2               "   \
+    "L1:     adc   ax, es:[di]      "   \
+    "        adc   ax, es:[di+2]    "   \
+    "        adc   ax, es:[di+4]    "   \
+    "        adc   ax, es:[di+6]    "   \
+    "        lea   di, [di+8]       "   \
+    "        loop  L1               "   \
+    "L2:     xchg  cx, bx           "   \
+    "        jcxz  L4               "   \
+    "L3:     adc   ax, es:[di]      "   \
+    "        inc   di               "   \
+    "        inc   di               "   \
+    "        loop  L3               "   \
+    "L4:     adc   ax, 0            "   \
+    "        adc   ax, 0            "   \
+    parm   [es di] [cx] [ax]            \
+    value  [ax]                         \
+    modify [bx cx di];
+#else
+static uint16_t sum_words(const void *wordptr, uint16_t words, uint16_t sum)
+{
+    const uint16_t *w;
+    uint32_t        acc;
+
+    w = (const uint16_t*)wordptr;
+    acc = sum;
+
+    while ( words >= 4 )
+    {
+        acc += w[0];
+        acc += w[1];
+        acc += w[2];
+        acc += w[3];
+        w += 4;
+        words -= 4;
+    }
+
+    while ( words > 0 )
+    {
+        acc += *w++;
+        words--;
+    }
+
+    acc = (acc >> 16) + (acc & 0x0000ffffUL);
+    acc = (acc >> 16) + (acc & 0x0000ffffUL);
+
+    return (uint16_t)acc;
+}
+#endif
+
+/*------------------------------------------------
+ * copy_sum_words()
+ *
+ *  copy 16-bit words and return their one's complement sum in host order.
+ *  on the V25 each word is loaded with 'lodsw', stored with 'stosw' and added with 'adc',
+ *  none of the string instructions change the carry, so the chain is only folded at the end.
+ *
+ * param:  destination and source pointers at any boundary, word count, 16-bit sum to add to
+ * return: folded 16-bit sum
+ *
+ */
+#ifdef __WATCOMC__
+static uint16_t copy_sum_words(void *dest, const void *src, uint16_t words, uint16_t sum);
+#pragma aux copy_sum_words =            \
+    "        push  ds               "   \
+    "        mov   ds, dx           "   \
+    "        mov   dx, bx           "   \
+    "        mov   bx, cx           "   \
+    "        and   bx, 3            "   \
+    "        shr   cx, 1            "   \
+    "        shr   cx, 1            "   \
+    "        clc                    "   \
+    "        jcxz  L2               "   \
+    "L1:     lodsw                  "   \
+    "        stosw                  "   \
+    "        adc   dx, ax           "   \
+    "        lodsw                  "   \
+    "        stosw                  "   \
+    "        adc   dx, ax           "   \
+    "        lodsw                  "   \
+    "        stosw                  "   \
+    "        adc   dx, ax           "   \
+    "        lodsw                  "   \
+    "        stosw                  "   \
+    "        adc   dx, ax           "   \
+    "        loop  L1               "   \
+    "L2:     xchg  cx, bx           "   \
+    "        jcxz  L4               "   \
+    "L3:     lodsw                  "   \
+    "        stosw                  "   \
+    "        adc   dx, ax           "   \
+    "        loop  L3               "   \
+    "L4:     adc   dx, 0            "   \
+    "        adc   dx, 0            "   \
+    "        pop   ds               "   \
+    parm   [es di] [dx si] [cx] [bx]    \
+    value  [dx]                         \
+    modify [ax bx cx si di];
+#else
+static uint16_t copy_sum_words(void *dest, const void *src, uint16_t words, uint16_t sum)
+{
+    const uint16_t *s;
+    uint16_t       *d;
+    uint32_t        acc;
+
+    s = (const uint16_t*)src;
+    d = (uint16_t*)dest;
+    acc = sum;
+
+    while ( words >= 4 )
+    {
+        acc += (d[0] = s[0]);
+        acc += (d[1] = s[1]);
+        acc += (d[2] = s[2]);
+        acc += (d[3] = s[3]);
+        s += 4;
+        d += 4;
+        words -= 4;
+    }
+
+    while ( words > 0 )
+    {
+        acc += (*d++ = *s++);
+        words--;
+    }
+
+    acc = (acc >> 16) + (acc & 0x0000ffffUL);
+    acc = (acc >> 16) + (acc & 0x0000ffffUL);
+
+    return (uint16_t)acc;
+}
+#endif
+
 /*------------------------------------------------
  * stack_checksumEx()
  *
  * Calculates checksum for 'len' bytes starting at 'dataptr'
  * accumulator size limits summable length to 64k
- * host endianess is irrelevant (p3 RFC1071)
+ * the data is summed a word at a time in host order, and the
+ * sum is converted once at the end (p3 RFC1071)
  * ** the caller must invert bits for Internet sum ! **
- * source: LwIP v2.0.2 inet_checksum.c
  *
  * param:  dataptr points to start of data to be summed at any boundary
  *         len length of data to be summed
- *         externally calculated accumulated sum
+ *         externally calculated accumulated sum, in network order words
  * return: host order (!) checksum (non-inverted Internet sum)
  *
  */
 uint16_t stack_checksumEx(const void *dataptr, int len, uint32_t accSum)
 {
     uint32_t        acc;
-    uint16_t        src;
-    const uint8_t  *octetptr;
+    uint16_t        sum, last;
 
-    acc = accSum;
-    /* dataptr may be at odd or even addresses */
-    octetptr = (const uint8_t*)dataptr;
-    while (len > 1)
-    {
-        /* declare first octet as most significant
-           thus assume network order, ignoring host order */
-        src = (*octetptr) << 8;
-        octetptr++;
-        /* declare second octet as least significant */
-        src |= (*octetptr);
-        octetptr++;
-        acc += src;
-        len -= 2;
-    }
+    /* fold the external sum and swap it to host order
+     */
+    acc = (accSum >> 16) + (accSum & 0x0000ffffUL);
+    acc = (acc >> 16) + (acc & 0x0000ffffUL);
+    sum = stack_ntoh((uint16_t)acc);
 
-    if (len > 0)
+    if ( len > 1 )
+        sum = sum_words(dataptr, (uint16_t)len >> 1, sum);
+
+    if ( len & 1 )
     {
-        /* accumulate remaining octet */
-        src = (*octetptr) << 8;
-        acc += src;
+        /* accumulate remaining octet, the low byte of a host order word */
+        last = ((const uint8_t*)dataptr)[len - 1];
+        sum += last;
+        if ( sum < last )
+            sum++;
     }
 
-    /* add deferred carry bits */
+    /* the host order sum is already byte swapped,
+     * the caller must invert bits for Internet sum !
+     */
+    return sum;
+}
+
+/*------------------------------------------------
+ * stack_copy_checksum()
+ *
+ * Copies 'len' bytes from 'src' to 'dest' and calculates their checksum
+ * in the same pass, so that outgoing payload is read only once.
+ * the sum is the same as stack_checksumEx() of the copied bytes.
+ * ** the caller must invert bits for Internet sum ! **
+ *
+ * param:  destination and source pointers at any boundary
+ *         len length of data to be copied and summed
+ *         externally calculated accumulated sum, in network order words
+ * return: host order (!) checksum (non-inverted Internet sum)
+ *
+ */
+uint16_t stack_copy_checksum(void *dest, const void *src, int len, uint32_t accSum)
+{
+    uint32_t        acc;
+    uint16_t        sum, last;
+
+    acc = (accSum >> 16) + (accSum & 0x0000ffffUL);
     acc = (acc >> 16) + (acc & 0x0000ffffUL);
-    if ((acc & 0xffff0000UL) != 0)
+    sum = stack_ntoh((uint16_t)acc);
+
+    if ( len > 1 )
+        sum = copy_sum_words(dest, src, (uint16_t)len >> 1, sum);
+
+    if ( len & 1 )
     {
-        acc = (acc >> 16) + (acc & 0x0000ffffUL);
+        last = ((const uint8_t*)src)[len - 1];
+        ((uint8_t*)dest)[len - 1] = (uint8_t)last;
+        sum += last;
+        if ( sum < last )
+            sum++;
     }
 
-    /* reorder sum, the caller must invert bits for Internet sum ! */
-    return stack_ntoh((uint16_t)acc);
+    return sum;
+}
+
+/*------------------------------------------------
+ * stack_checksum_update()
+ *
+ * Updates a header checksum after one 16-bit field of the header
+ * changed, without summing the header again (RFC 1624 eqn. 3):
+ *     HC' = ~(~HC + ~m + m')
+ * the checksum and fields are used as stored in the header, so
+ * host endianess is irrelevant.
+ *
+ * param:  stored checksum, old and new values of the field
+ * return: updated checksum to store in the header
+ *
+ */
+uint16_t stack_checksum_update(uint16_t checksum, uint16_t oldWord, uint16_t newWord)
+{
+    uint32_t        acc;
+
+    acc  = (uint16_t) ~checksum;
+    acc += (uint16_t) ~oldWord;
+    acc += newWord;
+
+    acc = (acc >> 16) + (acc & 0x0000ffffUL);
+    acc = (acc >> 16) + (acc & 0x0000ffffUL);
+
+    return ~((uint16_t)acc);
 }
 
 /*------------------------------------------------
@@ -37,13 +37,30 @@
 /* -----------------------------------------
    module macros and types
 ----------------------------------------- */
-#define     CIRC_BUFFER_MASK    ((uint16_t)TCP_DATA_BUF_SIZE -1)
+#define     CIRC_BUFFER_MASK    ((tcp_win_t)TCP_DATA_BUF_SIZE -1)
+#define     CHUNK_MASK          ((tcp_win_t)TCP_BUF_CHUNK -1)
+#define     PCB_HASH_MASK       (TCP_PCB_HASH -1)
+#define     NO_PCB              -1
+
+#define     SEQ_LT(a,b)         ((int32_t) ((uint32_t)(a) - (uint32_t)(b)) < 0)    // sequence number comparisons modulo 2^32
+#define     SEQ_LEQ(a,b)        ((int32_t) ((uint32_t)(a) - (uint32_t)(b)) <= 0)
+#define     SEQ_GT(a,b)         SEQ_LT(b,a)
+#define     SEQ_GEQ(a,b)        SEQ_LEQ(b,a)
+
+#define     pcb_hash(p)         ((int) ((uint16_t) tcpPCB[p].remoteIP ^ (uint16_t) (tcpPCB[p].remoteIP >> 16) ^ \
+                                        tcpPCB[p].remotePort ^ tcpPCB[p].localPort) & PCB_HASH_MASK)
 
 #define     send_syn(p)         send_segment(p, TCP_FLAG_SYN)
 #define     send_syn_ack(p)     send_segment(p, (TCP_FLAG_SYN+TCP_FLAG_ACK))
 #define     send_ack(p)         send_segment(p, TCP_FLAG_ACK)
 #define     send_fin_ack(p)     send_segment(p, (TCP_FLAG_FIN+TCP_FLAG_ACK))
 
+#if TCP_NAGLE
+#define     push_data(p)        (tcpPCB[p].pushEnd = tcpPCB[p].SND_NXT + unsent_bytes(p))
+#else
+#define     push_data(p)
+#endif
+
 #if DEBUG_ON
 #define     set_state(p,s)      {                                                                                        \
                                     printf("%s() connection %d, state change %d -> %d\n",__func__, p,tcpPCB[p].state,s); \
@@ -71,7 +88,14 @@ struct syn_opt_t                // structure to ease options setup when SYN flag
     uint8_t     mssOpt;         // mss option =2
     uint8_t     mssOptLen;      // mss option length =4
     uint16_t    mss;            // mss value
-    uint16_t    endOfOpt;       // filler =0
+    uint8_t     sackPermOpt;    // SACK permitted option =4, or filler =1
+    uint8_t     sackPermOptLen; // SACK permitted option length =2, or filler =1
+#if TCP_WIN_SCALE
+    uint8_t     nopOpt;         // filler =1
+    uint8_t     wsOpt;          // window scale option =3, or filler =1
+    uint8_t     wsOptLen;       // window scale option length =3, or filler =1
+    uint8_t     wsShift;        // window scale shift count, or filler =1
+#endif
 };
 
 struct opt_t                    // structure to ease options setup when SYN flag is off
@@ -80,7 +104,8 @@ struct opt_t                    // structure to ease options setup when SYN flag
     uint8_t     tsOptLen;       // time stamp option length =10
     uint32_t    tsTime;         // tx time stamp
     uint32_t    tsEcho;         // echo of received time stamp
-    uint16_t    endOfOpt;       // filler =0
+    uint8_t     sackOpt;        // SACK option =5 followed by SACK blocks, or filler =0
+    uint8_t     sackOptLen;     // SACK option length, or filler =0
 };
 
 #define         SYN_OPT_BYTES   sizeof(struct syn_opt_t)        // in uint8_t
@@ -88,33 +113,102 @@ struct opt_t                    // structure to ease options setup when SYN flag
 #define         OPT_BYTES       sizeof(struct opt_t)            // in uint8_t
 #define         OPT_LEN         ((OPT_BYTES / 4)+5)             // in uint32_t
 
-struct pseudo_header_t
-{
-    ip4_addr_t  srcIp;
-    ip4_addr_t  destIp;
-    uint8_t     zero;
-    uint8_t     protocol;
-    uint16_t    tcpLen;
-};
+#define         SMSS            (MSS - OPT_BYTES)               // sender maximum segment data size
+#define         INIT_CWND       ((uint32_t) ((SMSS > 2190) ? (2 * SMSS) : ((SMSS > 1095) ? (3 * SMSS) : (4 * SMSS)))) // RFC 5681 initial window
+#define         MAX_CWND        ((uint32_t) (TCP_MAX_INFLIGHT * SMSS)) // congestion window can't grow past the retransmit queue
+#define         DUPACK_THRESH   3                               // duplicate ACKs that trigger a fast retransmit (RFC 5681)
+#define         RCV_SWS_MIN     ((tcp_win_t) (((TCP_DATA_BUF_SIZE / 2) < MSS) ? (TCP_DATA_BUF_SIZE / 2) : MSS)) // smallest receive window increase (RFC 1122 4.2.3.3)
+
+#define         UNSCALED_WND(w) ((uint16_t) (((uint32_t)(w) > 0xffffUL) ? 0xffff : (w))) // window field of a segment that is not scaled
+#if TCP_WIN_SCALE
+#define         ADV_WND(p)      ((uint16_t) (tcpPCB[p].RCV_WND >> tcpPCB[p].rcvShift)) // window field advertised in a segment
+#else
+#define         ADV_WND(p)      (tcpPCB[p].RCV_WND)
+#endif
 
 /* -----------------------------------------
    module globals
 ----------------------------------------- */
 struct tcp_pcb_t    tcpPCB[TCP_PCB_COUNT];                      // TCP protocol control blocks
-uint8_t             sendBuff[TCP_PCB_COUNT][TCP_DATA_BUF_SIZE]; // set of transmit buffers, one per PCB
-uint8_t             recvBuff[TCP_PCB_COUNT][TCP_DATA_BUF_SIZE]; // set of receive buffers, one per PCB
+uint8_t             chunkPool[TCP_BUF_CHUNKS][TCP_BUF_CHUNK];   // send and receive buffer chunks shared by all PCBs
+uint8_t            *freeChunk[TCP_BUF_CHUNKS];                  // stack of free buffer chunks
+int                 freeChunks;                                 // free buffer chunk count
+pcbid_t             pcbHash[TCP_PCB_HASH];                      // connected PCBs by local and remote IP/port, linear probing, NO_PCB if empty
+pcbid_t             listenPcb[TCP_SERVER_COUNT];                // LISTENing PCBs, NO_PCB if not used
+pcbid_t             freePcb[TCP_PCB_COUNT];                     // stack of FREE PCBs
+int                 freePcbs;                                   // FREE PCB count
+int                 rtqBufs;                                    // pbufs held by all retransmit queues
+#if TCP_WIN_SCALE
+uint8_t             rcvWScale;                                  // window scale shift offered to peers, to fit TCP_DEF_WINDOW in 16 bits
+#endif
+#if TCP_TW_COUNT
+struct tcp_tw_t     twTable[TCP_TW_COUNT];                      // connections in TIME-WAIT
+#endif
 
 /* -----------------------------------------
    static functions
 ----------------------------------------- */
 static void      tcp_input_handler(struct pbuf_t* const);
 static pcbid_t   find_pcb(pcb_state_t, ip4_addr_t, uint16_t, ip4_addr_t, uint16_t);
+static void      pcb_hash_add(pcbid_t);
+static void      pcb_hash_remove(pcbid_t);
+static void      pcb_take(pcbid_t);
 static ip4_err_t send_segment(pcbid_t, uint16_t);
+static void      ack_text(pcbid_t, tcp_win_t);
+static void      send_probe(pcbid_t);
+static void      send_data(pcbid_t);
+static uint32_t  unsent_bytes(pcbid_t);
+static uint16_t  segment_bytes(pcbid_t, uint16_t);
+static tcp_win_t send_window(pcbid_t);
+static void      rtq_add(pcbid_t, struct pbuf_t*, uint32_t, uint16_t, uint16_t);
+static uint16_t  rtq_ack(pcbid_t, uint32_t);
+static void      rto_update(pcbid_t, uint32_t);
+static void      fast_retransmit(pcbid_t);
+#if TCP_CONGESTION_CTRL
+static void      cwnd_update(pcbid_t, uint32_t);
+static void      ssthresh_update(pcbid_t);
+static void      recovery_ack(pcbid_t, uint32_t);
+static void      rtq_resend(pcbid_t);
+#endif
+#if TCP_OOQ_SPANS
+static void      ooq_add(pcbid_t, uint8_t*);
+static void      ooq_merge(pcbid_t);
+#endif
+#if TCP_SACK
+static int       sack_mark(pcbid_t);
+static void      sack_resend(pcbid_t);
+static void      sack_reset(pcbid_t);
+#if TCP_OOQ_SPANS
+static void      sack_blocks(pcbid_t, struct tcp_span_t*, uint8_t);
+#endif
+#endif
 static ip4_err_t send_rst_segment(ip4_addr_t, uint16_t, ip4_addr_t, uint16_t, uint32_t, uint32_t, uint16_t, uint16_t);
+#if TCP_HDR_PREDICT
+static int       hdr_predict(pcbid_t, uint16_t, uint16_t, uint8_t*);
+#endif
+static tcp_win_t buf_room(uint8_t**, tcp_win_t, tcp_win_t, int);
+static void      buf_write(uint8_t**, tcp_win_t, uint8_t*, tcp_win_t);
+static void      buf_read(uint8_t**, tcp_win_t, uint8_t*, tcp_win_t, uint32_t*);
+static void      buf_trim(pcbid_t);
+static void      buf_free(pcbid_t);
 static void      get_tcp_opt(uint8_t, uint8_t*, struct tcp_opt_t*);
-static uint32_t  pseudo_header_sum(ip4_addr_t, ip4_addr_t, uint16_t);
+#if TCP_WIN_SCALE
+static void      set_win_scale(pcbid_t);
+#endif
+static uint32_t  payload_sum(pcbid_t, uint8_t*, uint32_t, uint16_t, uint16_t);
+static int       has_sum_hint(pcbid_t, uint32_t, uint16_t);
+static void      add_sum_hint(pcbid_t, uint32_t, uint16_t, uint16_t);
+static uint16_t  produce_data(pcbid_t, uint8_t*, uint32_t, uint16_t);
+#if TCP_HDR_TEMPLATE
+static struct net_interface_t* hdr_template(pcbid_t);
+#endif
 static void      tcp_timeout_handler(uint32_t);
 static void      free_tcp_pcb(pcbid_t);
+#if TCP_TW_COUNT
+static void      time_wait(pcbid_t);
+static int       find_tw(ip4_addr_t, uint16_t, ip4_addr_t, uint16_t);
+static int       tw_input(int, struct tcp_t*);
+#endif
 
 /*------------------------------------------------
  * tcp_init()
@@ -129,17 +223,32 @@ void tcp_init(void)
 {
     pcbid_t     i;
 
+#if TCP_WIN_SCALE
+    for (rcvWScale = 0; ((uint32_t) TCP_DEF_WINDOW >> rcvWScale) > 0xffffUL && rcvWScale < TCP_WSCALE_MAX; rcvWScale++);
+#endif
+
     for (i = 0; i < TCP_PCB_COUNT; i++)                     // initialize PCB list
     {
-        memset(&(tcpPCB[i]), 0, sizeof(struct tcp_pcb_t));  // clear variable and set state
+        memset(&(tcpPCB[i]), 0, sizeof(struct tcp_pcb_t));  // clear variable and set state, no buffer chunks are held
         tcpPCB[i].state = FREE;
-
-        tcpPCB[i].send = &(sendBuff[i][0]);                 // link to send and receive buffers
-        tcpPCB[i].recv = &(recvBuff[i][0]);
+        freePcb[i] = (TCP_PCB_COUNT - 1) - i;               // all PCBs are free, lowest ID on top
     }
+    freePcbs = TCP_PCB_COUNT;
+
+    for (i = 0; i < TCP_PCB_HASH; i++)                      // no connections or listeners
+        pcbHash[i] = NO_PCB;
+    for (i = 0; i < TCP_SERVER_COUNT; i++)
+        listenPcb[i] = NO_PCB;
+#if TCP_TW_COUNT
+    memset(twTable, 0, sizeof(twTable));                    // no connections in TIME-WAIT
+#endif
+
+    for (i = 0; i < TCP_BUF_CHUNKS; i++)                    // all send and receive buffer chunks are free
+        freeChunk[i] = &(chunkPool[i][0]);
+    freeChunks = TCP_BUF_CHUNKS;
 
     stack_set_protocol_handler(IP4_TCP, tcp_input_handler); // setup the stack handler for incoming TCP segments
-    stack_set_timer(250, tcp_timeout_handler);              // timeout handler runs every 250mSec
+    stack_set_timer(TCP_TIMER_TICK, tcp_timeout_handler);   // timeout handler runs every TCP_TIMER_TICK mSec
 }
 
 /*------------------------------------------------
@@ -154,15 +263,8 @@ void tcp_init(void)
  */
 pcbid_t tcp_new(void)
 {
-    int     i;
-
-    for (i = 0; i < TCP_PCB_COUNT; i++)                     // scan PCB list
-    {
-        if ( tcpPCB[i].state == FREE )
-        {
-            return i;                                       // return TCP PCB address if a free one exists
-        }
-    }
+    if ( freePcbs > 0 )
+        return freePcb[freePcbs - 1];                       // return TCP PCB address if a free one exists, it is taken when it is bound
 
     return ERR_PCB_ALLOC;                                   // return error if no TCP PCB is available
 }
@@ -222,7 +324,9 @@ ip4_err_t tcp_bind(pcbid_t pcbId, ip4_addr_t addr, uint16_t port)
         }
     }
 
-    tcpPCB[pcbId].localIP = addr;                           // ok to bind
+    if ( tcpPCB[pcbId].state == FREE )                      // ok to bind
+        pcb_take(pcbId);
+    tcpPCB[pcbId].localIP = addr;
     tcpPCB[pcbId].localPort = port;
     set_state(pcbId,BOUND);
 
@@ -276,10 +380,12 @@ ip4_err_t tcp_close(pcbid_t pcbId)
             }
             break;
 
-        /* TODO queue this until all preceding SENDs have been segmentized, then
-         * form a FIN segment and send it.  In any case, enter FIN-WAIT-1 state.
+        /* the FIN segment is sent after all preceding SENDs have been segmentized,
+         * until then ERR_TCP_WACK is returned and the close should be retried.
+         * then enter FIN-WAIT-1 state.
          */
         case ESTABLISHED:
+            push_data(pcbId);                                                           // the FIN pushes the data queued before it
             result = send_fin_ack(pcbId);
             if ( result == ERR_OK ||
                  result == ERR_ARP_QUEUE )
@@ -288,10 +394,11 @@ ip4_err_t tcp_close(pcbid_t pcbId)
             }
             break;
 
-        /* TODO queue this request until all preceding SENDs have been
-         * segmentized; then send a FIN segment, enter LAST_ACK state.
+        /* the FIN segment is sent after all preceding SENDs have been
+         * segmentized, until then ERR_TCP_WACK is returned. then enter LAST_ACK state.
          */
         case CLOSE_WAIT:
+            push_data(pcbId);
             result = send_fin_ack(pcbId);
             if ( result == ERR_OK ||
                  result == ERR_ARP_QUEUE )
@@ -323,7 +430,8 @@ ip4_err_t tcp_close(pcbid_t pcbId)
  * tcp_listen()
  *
  *  this function starts a server's passive-open waiting
- *  to accept up to TCP_MAX_ACCEPT incoming client connections
+ *  to accept up to TCP_MAX_ACCEPT incoming client connections.
+ *  up to TCP_SERVER_COUNT PCBs can listen at the same time.
  *
  * param:  valid PCB ID
  * return: ERR_OK if no errors or ip4_err_t with error code
@@ -331,12 +439,23 @@ ip4_err_t tcp_close(pcbid_t pcbId)
  */
 ip4_err_t tcp_listen(pcbid_t pcbId)
 {
+    int     i;
+
     if ( pcbId >= TCP_PCB_COUNT )
         return ERR_PCB_ALLOC;
 
     if ( tcpPCB[pcbId].state != BOUND )                     // only works for BOUND state PCBs
         return ERR_NOT_BOUND;
 
+    for (i = 0; i < TCP_SERVER_COUNT; i++)                  // add to the listener table
+    {
+        if ( listenPcb[i] == NO_PCB )
+            break;
+    }
+    if ( i == TCP_SERVER_COUNT )                            // no more than TCP_SERVER_COUNT listeners
+        return ERR_PCB_ALLOC;
+    listenPcb[i] = pcbId;
+
     set_state(pcbId,LISTEN);                                // set to LISTEN state
 
     return ERR_OK;
@@ -387,12 +506,17 @@ ip4_err_t tcp_connect(pcbid_t pcbId, ip4_addr_t serverIP, uint16_t serverPort)
     if ( tcpPCB[pcbId].state != BOUND )                     // contrary to typical socket API and RFC 793, must be BOUND state PCBs
             return ERR_NOT_BOUND;
 
+    pcb_hash_remove(pcbId);                                 // in case this is a retry
     tcpPCB[pcbId].remoteIP = serverIP;                      // update PCB with local and remote servers IP/port
     tcpPCB[pcbId].remotePort = serverPort;
+    pcb_hash_add(pcbId);
     tcpPCB[pcbId].ISS = stack_time();                       // select an initial ISS
     tcpPCB[pcbId].SND_UNA = tcpPCB[pcbId].ISS;              // UNA and NXT are equal before sending the SYN
     tcpPCB[pcbId].SND_NXT = tcpPCB[pcbId].ISS;              // NXT will be updated by send_syn() if it is successful
     tcpPCB[pcbId].SND_opt.mss = MSS;
+#if TCP_WIN_SCALE
+    tcpPCB[pcbId].SND_opt.winScale = rcvWScale;             // always offer window scaling in a SYN
+#endif
 
     tcpPCB[pcbId].SND_WND = TCP_DEF_WINDOW;
     tcpPCB[pcbId].SND_UP = 0;
@@ -402,6 +526,11 @@ ip4_err_t tcp_connect(pcbid_t pcbId, ip4_addr_t serverIP, uint16_t serverPort)
     tcpPCB[pcbId].RCV_WND = TCP_DEF_WINDOW;
 
     tcpPCB[pcbId].RT0 = DEF_RTT;
+#if TCP_CONGESTION_CTRL
+    tcpPCB[pcbId].cwnd = INIT_CWND;
+    tcpPCB[pcbId].ssthresh = 0xffffffffUL;                  // arbitrarily high, until the first loss
+    tcpPCB[pcbId].recover = tcpPCB[pcbId].ISS;
+#endif
 
     result = send_syn(pcbId);                               // send SYN segment to server
 
@@ -439,6 +568,9 @@ int tcp_is_connected(pcbid_t pcbId)
  *  send data from a buffer, returns byte count actually sent
  *  create this function instead of a callback method upon connection
  *
+ *  with TCP_NAGLE data that is not pushed with TCP_FLAG_PSH may be held
+ *  until more data fills a segment, tcp_flush() or tcp_close() (RFC 1122 4.2.2.2)
+ *
  * param:  valid PCB ID, application/user source buffer, byte count to send,
  *         flags: 0 or TCP_FLAG_PSH or TCP_FLAG_URG (TCP_FLAG_URG not implemented)
  * return: byte count actually sent, or ip4_err_t error code 
@@ -447,7 +579,7 @@ int tcp_is_connected(pcbid_t pcbId)
 int tcp_send(pcbid_t pcbId, uint8_t* const data, uint16_t count, uint16_t flags)
 {
     int     result = 0;
-    int     bytes, i;
+    int     bytes;
 
 #if DEBUG_ON
     printf("-> %s()\n", __func__);
@@ -486,20 +618,20 @@ int tcp_send(pcbid_t pcbId, uint8_t* const data, uint16_t count, uint16_t flags)
      */
     case CLOSE_WAIT:
     case ESTABLISHED:
-        if ( (bytes = (TCP_DATA_BUF_SIZE - tcpPCB[pcbId].sendCnt)) > 0 )                // determine if space is available in send buffer
+        if ( tcpPCB[pcbId].producer != NULL )                                           // data from a producer must be sent first
+            result = ERR_MEM;
+        else if ( (bytes = (TCP_DATA_BUF_SIZE - tcpPCB[pcbId].sendCnt)) > 0 &&          // determine if space is available in send buffer
+                  (bytes = (int) buf_room(tcpPCB[pcbId].send, tcpPCB[pcbId].sendWRp,   // and in the buffer chunks it holds or can get
+                                          (bytes > count) ? count : (tcp_win_t) bytes, TCP_BUF_RESERVE)) > 0 )
         {
-            if (bytes > count)                                                          // adjust count to lower number
-                bytes = count;
-
-            for ( i = 0; i < bytes; i++ )                                               // byte copy loop
-            {
-                tcpPCB[pcbId].send[tcpPCB[pcbId].sendWRp] = data[i];                    // copy a byte
-                tcpPCB[pcbId].sendCnt++;                                                // increment total byte count
-                tcpPCB[pcbId].sendWRp++;                                                // adjust buffer write pointer
-                tcpPCB[pcbId].sendWRp &= CIRC_BUFFER_MASK;                              // quick way to make pointer circular
-            }
+            buf_write(tcpPCB[pcbId].send, tcpPCB[pcbId].sendWRp, data, (tcp_win_t) bytes); // copy bytes into the buffer
+            tcpPCB[pcbId].sendCnt += bytes;                                             // increment total byte count
+            tcpPCB[pcbId].sendWRp += bytes;                                             // adjust buffer write pointer
+            tcpPCB[pcbId].sendWRp &= CIRC_BUFFER_MASK;                                  // quick way to make pointer circular
             result = bytes;                                                             // return number of bytes copied
-            send_segment(pcbId, flags + TCP_FLAG_ACK);                                  // send data in a segment with specified flags
+            if ( flags & TCP_FLAG_PSH )
+                push_data(pcbId);
+            send_data(pcbId);                                                           // send data in as many segments as the window allows
         }
         else
             result = ERR_MEM;
@@ -519,6 +651,176 @@ int tcp_send(pcbid_t pcbId, uint8_t* const data, uint16_t count, uint16_t flags)
     return result;
 }
 
+/*------------------------------------------------
+ * tcp_send_sum()
+ *
+ *  send data from a buffer with a precomputed checksum of the data,
+ *  such as a static resource whose checksums were calculated off-line.
+ *  the checksum is remembered with the data's sequence range, and if a
+ *  segment is built with the range in it then the checksum is used instead of
+ *  summing the range's bytes. to keep the checksum valid for the whole range
+ *  the data is either queued in its entirety or not at all.
+ *
+ * param:  valid PCB ID, application/user source buffer, byte count to send,
+ *         flags: 0 or TCP_FLAG_PSH, checksum of the data as returned by stack_checksum()
+ * return: byte count actually sent, or ip4_err_t error code
+ *
+ */
+int tcp_send_sum(pcbid_t pcbId, uint8_t* const data, uint16_t count, uint16_t flags, uint16_t sum)
+{
+    if ( count == 0 || data == NULL )
+        return 0;
+
+    if ( pcbId >= TCP_PCB_COUNT )
+        return ERR_PCB_ALLOC;
+
+    if ( tcpPCB[pcbId].state == ESTABLISHED || tcpPCB[pcbId].state == CLOSE_WAIT )
+    {
+        if ( tcpPCB[pcbId].producer != NULL ||
+             (TCP_DATA_BUF_SIZE - tcpPCB[pcbId].sendCnt) < count ||                     // all or nothing
+             buf_room(tcpPCB[pcbId].send, tcpPCB[pcbId].sendWRp, count, TCP_BUF_RESERVE) < count )
+            return ERR_MEM;
+
+        add_sum_hint(pcbId, tcpPCB[pcbId].SND_NXT +                                     // sequence number of first byte to be added to the send buffer
+                            (tcpPCB[pcbId].sendCnt - tcpPCB[pcbId].sendInFlight), count, sum);
+    }
+
+    return tcp_send(pcbId, data, count, flags);
+}
+
+/*------------------------------------------------
+ * tcp_send_from()
+ *
+ *  send data that is written directly into outgoing segments by a producer
+ *  call-back, instead of being copied into the send buffer first.
+ *  when a segment is built and the window allows, the producer is called with
+ *  the offset of the next byte, the segment's payload area and the maximum byte
+ *  count to write. the producer returns the byte count it wrote, and may also
+ *  return the checksum of these bytes, as returned by stack_checksum(), to save
+ *  summing them. a returned checksum of '0' means no checksum.
+ *  a producer that returns '0' or an error before it wrote all its data failed,
+ *  it is released and tcp_send_pending() returns ERR_TCP_PRODUCER.
+ *  the data is sent after any data already in the send buffer, and tcp_send()
+ *  will not accept more data until the producer wrote all its data.
+ *  the producer's data and the data queued before it are pushed, so they are
+ *  sent without waiting for more data, even if the byte count is '0'.
+ *  the producer and its context must stay valid until tcp_send_pending() is not '1'.
+ *
+ * param:  valid PCB ID, producer call-back, producer context, byte count to send
+ * return: ERR_OK if data is accepted, or ip4_err_t error code
+ *
+ */
+ip4_err_t tcp_send_from(pcbid_t pcbId, tcp_producer_fn producer, void *ctx, uint32_t length)
+{
+    if ( pcbId >= TCP_PCB_COUNT )
+        return ERR_PCB_ALLOC;
+
+    switch ( tcpPCB[pcbId].state )
+    {
+    case FREE:
+    case BOUND:
+    case LISTEN:
+        return ERR_TCP_CLOSED;
+
+    case SYN_RECEIVED:
+    case SYN_SENT:
+        return ERR_MEM;
+
+    case CLOSE_WAIT:
+    case ESTABLISHED:
+        if ( tcpPCB[pcbId].producer != NULL )                                           // one producer at a time
+            return ERR_MEM;
+
+        if ( producer != NULL && length > 0 )
+        {
+            tcpPCB[pcbId].producer = producer;
+            tcpPCB[pcbId].producerCtx = ctx;
+            tcpPCB[pcbId].prodLen = length;
+            tcpPCB[pcbId].prodOffset = 0L;
+        }
+        tcpPCB[pcbId].prodFailed = 0;
+        push_data(pcbId);                                                               // the producer's data is pushed, with the data queued before it
+        send_data(pcbId);                                                               // start sending if the window allows
+        return ERR_OK;
+
+    default:
+        return ERR_TCP_CLOSING;
+    }
+}
+
+/*------------------------------------------------
+ * tcp_send_pending()
+ *
+ *  check if data of tcp_send_from() still needs to be written by the producer
+ *
+ * param:  valid PCB ID
+ * return: '1' if the producer is still in use, '0' if it is not,
+ *         ERR_TCP_PRODUCER if the producer failed and its data will not be sent
+ *
+ */
+int tcp_send_pending(pcbid_t pcbId)
+{
+    if ( pcbId >= TCP_PCB_COUNT )
+        return 0;
+
+    if ( tcpPCB[pcbId].prodFailed )
+        return ERR_TCP_PRODUCER;
+
+    return (tcpPCB[pcbId].producer != NULL);
+}
+
+/*------------------------------------------------
+ * tcp_flush()
+ *
+ *  push the data queued with tcp_send() without TCP_FLAG_PSH,
+ *  so it is sent without waiting for more data to fill a segment
+ *
+ * param:  valid PCB ID
+ * return: ERR_OK if data is pushed, or ip4_err_t error code
+ *
+ */
+ip4_err_t tcp_flush(pcbid_t pcbId)
+{
+    if ( pcbId >= TCP_PCB_COUNT )
+        return ERR_PCB_ALLOC;
+
+    if ( tcpPCB[pcbId].state != ESTABLISHED && tcpPCB[pcbId].state != CLOSE_WAIT )
+        return ERR_TCP_CLOSED;
+
+    push_data(pcbId);
+    send_data(pcbId);
+
+    return ERR_OK;
+}
+
+/*------------------------------------------------
+ * tcp_nodelay()
+ *
+ *  by default, with TCP_NAGLE, data is sent in full segments if possible:
+ *  a small segment is held while another small segment waits for an ACK,
+ *  and data that is not pushed is held until it fills a segment.
+ *  a connection set to 'no delay' sends the data it has as soon as
+ *  the window allows, for interactive applications that write small messages
+ *
+ * param:  valid PCB ID, '1' to send without delay or '0' for the default
+ * return: ERR_OK, or ip4_err_t error code
+ *
+ */
+ip4_err_t tcp_nodelay(pcbid_t pcbId, int noDelay)
+{
+    if ( pcbId >= TCP_PCB_COUNT )
+        return ERR_PCB_ALLOC;
+
+#if TCP_NAGLE
+    tcpPCB[pcbId].noDelay = (noDelay != 0);
+    if ( noDelay &&
+         (tcpPCB[pcbId].state == ESTABLISHED || tcpPCB[pcbId].state == CLOSE_WAIT) )
+        send_data(pcbId);                                                               // send what was held
+#endif
+
+    return ERR_OK;
+}
+
 /*------------------------------------------------
  * tcp_recv()
  *
@@ -531,8 +833,11 @@ int tcp_send(pcbid_t pcbId, uint8_t* const data, uint16_t count, uint16_t flags)
  */
 int tcp_recv(pcbid_t pcbId, uint8_t* const data, uint16_t count)
 {
-    int     result = 0;
-    int     bytes, i;
+    int         result = 0;
+    int         bytes;
+#if TCP_RCV_SWS
+    tcp_win_t   window;
+#endif
 
 #if DEBUG_ON
     printf("-> %s()\n", __func__);
@@ -585,14 +890,34 @@ int tcp_recv(pcbid_t pcbId, uint8_t* const data, uint16_t count)
                 if (bytes > count)                                                      // adjust count to lower number
                     bytes = count;
 
-                for ( i = 0; i < bytes; i++ )                                           // byte copy loop
+                buf_read(tcpPCB[pcbId].recv, tcpPCB[pcbId].recvRDp, data, (tcp_win_t) bytes, NULL); // copy bytes out of the buffer
+                tcpPCB[pcbId].recvCnt -= bytes;                                         // decrement count
+                tcpPCB[pcbId].recvRDp += bytes;                                         // adjust buffer read pointer
+                tcpPCB[pcbId].recvRDp &= CIRC_BUFFER_MASK;                              // quick way to make pointer circular
+                buf_trim(pcbId);                                                        // return chunks that were read to the pool
+#if TCP_RCV_SWS
+                /* receiver SWS avoidance (RFC 1122 4.2.3.3), the window is opened to the free
+                 * buffer space only when it grows by at least min(buffer/2, MSS), so the sender
+                 * is not offered a few bytes at a time after every small read.
+                 * a window update is sent when the right edge moves that far beyond the one
+                 * advertised last, the sender may be waiting for it with a closed or small window
+                 */
+                window = (tcp_win_t) TCP_DATA_BUF_SIZE - (tcp_win_t) tcpPCB[pcbId].recvCnt;
+                if ( (window - tcpPCB[pcbId].RCV_WND) >= RCV_SWS_MIN )
                 {
-                    data[i] = tcpPCB[pcbId].recv[tcpPCB[pcbId].recvRDp];                // copy a byte
-                    tcpPCB[pcbId].recvCnt--;                                            // decrement count
-                    tcpPCB[pcbId].recvRDp++;                                            // adjust buffer read pointer
-                    tcpPCB[pcbId].recvRDp &= CIRC_BUFFER_MASK;                          // quick way to make pointer circular
+                    tcpPCB[pcbId].RCV_WND = window;
+                    if ( (tcpPCB[pcbId].RCV_NXT + window) >= (tcpPCB[pcbId].rcvAdv + RCV_SWS_MIN) )
+                        send_ack(pcbId);
+                }
+#else
+                if ( ADV_WND(pcbId) == 0 )                                              // if the window was closed then tell the sender
+                {                                                                       // it is open again, the sender will not probe it
+                    tcpPCB[pcbId].RCV_WND += bytes;
+                    send_ack(pcbId);
                 }
-                tcpPCB[pcbId].RCV_WND += bytes;                                         // adjust windows size to space in buffer
+                else
+                    tcpPCB[pcbId].RCV_WND += bytes;                                     // adjust windows size to space in buffer
+#endif
                 result = bytes;                                                         // return number of bytes copied
             }
             break;
@@ -692,8 +1017,11 @@ static void tcp_input_handler(struct pbuf_t* const p)
     uint16_t            dataOff;
     uint16_t            segLen;
     pcbid_t             pcbId, newConnPcb;
-    int                 bytes, i;
+    int                 bytes, newSacks = 0;
     ip4_err_t           result;
+#if TCP_TW_COUNT
+    int                 tw;
+#endif
 
 #if DEBUG_ON
     printf("-> %s()\n", __func__);
@@ -707,12 +1035,15 @@ static void tcp_input_handler(struct pbuf_t* const p)
     addrRemote = ip->srcIp;                                                             // extract source IP and port
     portRemote = stack_ntoh(tcp->srcPort);
 
-    dataOff = 4 * (stack_ntoh(tcp->dataOffsAndFlags) >> 12);
-    segLen = p->len - FRAME_HDR_LEN - ((ip->verHeaderLength & 0x0f) * 4) - dataOff;
-
-    /* TODO run TCP checksum test and drop packet if
+    /* run TCP checksum test and drop packet if
      * TCP checksum does not match.
+     * the segment length is taken from the IP header, so that Ethernet padding is not counted
      */
+    if ( ip4_payload_checksum(p) != 0xffff )
+        return;
+
+    dataOff = 4 * (stack_ntoh(tcp->dataOffsAndFlags) >> 12);
+    segLen = stack_ntoh(ip->length) - ((ip->verHeaderLength & 0x0f) * 4) - dataOff;
 
     /* parse the incoming packet by examining the TCP flags and determining
      * the actions/state-change to be taken. The processing here follows
@@ -722,6 +1053,11 @@ static void tcp_input_handler(struct pbuf_t* const p)
     pcbId = find_pcb(ANY_STATE, addrLocal, portLocal, addrRemote, portRemote);              // first find a fully qualified PCB
     if ( pcbId < 0 )                                                                        // if PCB not found
     {
+#if TCP_TW_COUNT
+        tw = find_tw(addrLocal, portLocal, addrRemote, portRemote);                         // a connection in TIME-WAIT has no PCB
+        if ( tw >= 0 && tw_input(tw, tcp) )
+            return;
+#endif
         pcbId = find_pcb(LISTEN, addrLocal, portLocal, IP4_ADDR_ANY, 0);                    // try to find a LISTENing PCB
         if ( pcbId < 0 )                                                                    // can only have one match, so if not found
             {
@@ -744,14 +1080,14 @@ static void tcp_input_handler(struct pbuf_t* const p)
                 {
                     send_rst_segment(addrLocal, portLocal, addrRemote, portRemote,
                                      stack_ntohl(tcp->ack), 0L,
-                                     TCP_DEF_WINDOW,
+                                     UNSCALED_WND(TCP_DEF_WINDOW),
                                      TCP_FLAG_RST);
                 }
                 else
                 {
                     send_rst_segment(addrLocal, portLocal, addrRemote, portRemote,
                                      0L, stack_ntohl(tcp->seq) + segLen,
-                                     TCP_DEF_WINDOW,
+                                     UNSCALED_WND(TCP_DEF_WINDOW),
                                      TCP_FLAG_RST + TCP_FLAG_ACK);
                 }
                 return;                                                                     // drop the packet
@@ -766,6 +1102,25 @@ static void tcp_input_handler(struct pbuf_t* const p)
     tcpPCB[pcbId].SEG_WND = stack_ntoh(tcp->window);
     tcpPCB[pcbId].SEG_UP  = stack_ntoh(tcp->urgentPtr);
 
+#if TCP_WIN_SCALE
+    if ( !(flags & TCP_FLAG_SYN) )                                                          // the window field of a SYN is never scaled
+        tcpPCB[pcbId].SEG_WND <<= tcpPCB[pcbId].sndShift;
+    tcpPCB[pcbId].RCV_opt.winScale = TCP_WSCALE_NONE;                                       // these options are only valid for this segment
+#endif
+#if TCP_SACK
+    tcpPCB[pcbId].RCV_opt.sackOk = 0;                                                       // these options are only valid for this segment
+    tcpPCB[pcbId].RCV_opt.sackCount = 0;
+#endif
+
+#if TCP_HDR_PREDICT
+    /* header prediction (Van Jacobson), in a bulk transfer almost every segment
+     * is the next in-order pure ACK or data segment of an ESTABLISHED connection.
+     * those are handled without option parsing and the event processing below
+     */
+    if ( hdr_predict(pcbId, flags, dataOff, &(tcp->payloadStart)) )
+        return;
+#endif
+
     if ( dataOff > 20 )                                                                     // get TCP options
     {
         get_tcp_opt((dataOff-20), &(tcp->payloadStart), &(tcpPCB[pcbId].RCV_opt));
@@ -787,7 +1142,7 @@ static void tcp_input_handler(struct pbuf_t* const p)
              */
             send_rst_segment(addrLocal, portLocal, addrRemote, portRemote,
                              stack_ntohl(tcp->ack), 0L,
-                             TCP_DEF_WINDOW,
+                             UNSCALED_WND(TCP_DEF_WINDOW),
                              TCP_FLAG_RST);
             return;
         }
@@ -802,12 +1157,14 @@ static void tcp_input_handler(struct pbuf_t* const p)
 #endif
                 return;
             }
+            pcb_take(newConnPcb);
             tcpPCB[newConnPcb].state = LISTEN;                                              // duplicate the LISTENing PCB to the new active connection
             tcpPCB[newConnPcb].timeInState = tcpPCB[pcbId].timeInState;
             tcpPCB[newConnPcb].localIP = tcpPCB[pcbId].localIP;
             tcpPCB[newConnPcb].localPort = tcpPCB[pcbId].localPort;
             tcpPCB[newConnPcb].remoteIP = addrRemote;
             tcpPCB[newConnPcb].remotePort = portRemote;
+            pcb_hash_add(newConnPcb);
             tcpPCB[newConnPcb].RCV_NXT = tcpPCB[pcbId].SEG_SEQ + 1;
             tcpPCB[newConnPcb].RCV_WND = TCP_DEF_WINDOW;
             tcpPCB[newConnPcb].IRS = tcpPCB[pcbId].SEG_SEQ;
@@ -816,8 +1173,23 @@ static void tcp_input_handler(struct pbuf_t* const p)
             tcpPCB[newConnPcb].SND_NXT = tcpPCB[newConnPcb].ISS;
             tcpPCB[newConnPcb].SND_WND = TCP_DEF_WINDOW;
             tcpPCB[newConnPcb].RT0 = DEF_RTT;
+#if TCP_CONGESTION_CTRL
+            tcpPCB[newConnPcb].cwnd = INIT_CWND;
+            tcpPCB[newConnPcb].ssthresh = 0xffffffffUL;
+            tcpPCB[newConnPcb].recover = tcpPCB[newConnPcb].ISS;
+#endif
             tcpPCB[newConnPcb].SND_opt.mss = MSS;
             memcpy(&(tcpPCB[newConnPcb].RCV_opt), &(tcpPCB[pcbId].RCV_opt), sizeof(struct tcp_opt_t));
+#if TCP_SACK
+            tcpPCB[newConnPcb].sackOk = tcpPCB[pcbId].RCV_opt.sackOk;                     // send SACK if the client permitted it
+#endif
+#if TCP_WIN_SCALE
+            if ( tcpPCB[pcbId].RCV_opt.winScale != TCP_WSCALE_NONE )                        // offer window scaling only if the client did
+                tcpPCB[newConnPcb].SND_opt.winScale = rcvWScale;
+            else
+                tcpPCB[newConnPcb].SND_opt.winScale = TCP_WSCALE_NONE;
+            set_win_scale(newConnPcb);
+#endif
             tcpPCB[newConnPcb].tcp_accept_fn = tcpPCB[pcbId].tcp_accept_fn;
             tcpPCB[newConnPcb].tcp_notify_fn = tcpPCB[pcbId].tcp_notify_fn;
             result = send_syn_ack(newConnPcb);                                              // send <SEQ=ISS><ACK=RCV.NXT><CTL=SYN,ACK>
@@ -852,7 +1224,7 @@ static void tcp_input_handler(struct pbuf_t* const p)
                 {
                     send_rst_segment(addrLocal, portLocal, addrRemote, portRemote,          // send reset <SEQ=SEG.ACK><CTL=RST>
                                      stack_ntohl(tcp->ack), 0L,
-                                     TCP_DEF_WINDOW,
+                                     UNSCALED_WND(TCP_DEF_WINDOW),
                                      TCP_FLAG_RST);
                     return;
                 }
@@ -866,20 +1238,10 @@ static void tcp_input_handler(struct pbuf_t* const p)
         }
 
         /* at this point the ACK is good
-         * so we need to check matching ACK to sent SYN and if ok
-         * clear the queued SYN packed we have sent
+         * so clear the queued SYN we have sent
          */
-        if ( tcpPCB[pcbId].sendTime == tcpPCB[pcbId].RCV_opt.echoTime )                     // if the send time matches the echo time stamp of queued packet
-        {                                                                                   // then this Ack is for the queued packet
-            pbuf_free(tcpPCB[pcbId].pbufQ);                                                 // free the pbuf and
-            tcpPCB[pcbId].sendTime = 0L;                                                    // removed queued segment from retransmit queue
-            tcpPCB[pcbId].resendTime = 0L;
-            tcpPCB[pcbId].retranCnt = 0;
-            tcpPCB[pcbId].pbufQ = NULL;
-
-            /* TODO calculate RTT here
-             */
-        }
+        if ( flags & TCP_FLAG_ACK )
+            rtq_ack(pcbId, tcpPCB[pcbId].SEG_ACK);
 
         /* second, if the RST bit is set then signal the user "error:
          * connection reset", drop the segment, enter CLOSED state,
@@ -923,6 +1285,12 @@ static void tcp_input_handler(struct pbuf_t* const p)
         {
             tcpPCB[pcbId].RCV_NXT = tcpPCB[pcbId].SEG_SEQ + 1;
             tcpPCB[pcbId].IRS = tcpPCB[pcbId].SEG_SEQ;
+#if TCP_SACK
+            tcpPCB[pcbId].sackOk = tcpPCB[pcbId].RCV_opt.sackOk;                            // the server permitted SACK too
+#endif
+#if TCP_WIN_SCALE
+            set_win_scale(pcbId);                                                           // scale windows if the server offered it too
+#endif
             if ( flags & TCP_FLAG_ACK)
                 tcpPCB[pcbId].SND_UNA = tcpPCB[pcbId].SEG_ACK;
             if ( tcpPCB[pcbId].SND_UNA > tcpPCB[pcbId].ISS )
@@ -1009,7 +1377,7 @@ static void tcp_input_handler(struct pbuf_t* const p)
         {
             send_rst_segment(addrLocal, portLocal, addrRemote, portRemote,
                              stack_ntohl(tcp->ack), 0L,
-                             TCP_DEF_WINDOW,
+                             UNSCALED_WND(TCP_DEF_WINDOW),
                              TCP_FLAG_RST);
             send_sig(pcbId,TCP_EVENT_ABORTED);
             free_tcp_pcb(pcbId);
@@ -1037,6 +1405,9 @@ static void tcp_input_handler(struct pbuf_t* const p)
                     tcpPCB[pcbId].SND_WL1 = tcpPCB[pcbId].SEG_SEQ;
                     tcpPCB[pcbId].SND_WL2 = tcpPCB[pcbId].SEG_ACK;
 
+                    rtq_ack(pcbId, tcpPCB[pcbId].SEG_ACK);                                  // our SYN is acknowledged, remove it from retransmit queue
+                    tcpPCB[pcbId].SND_UNA = tcpPCB[pcbId].SEG_ACK;
+
                     if ( tcpPCB[pcbId].tcp_accept_fn != NULL )                              // guard, but should never be NULL
                         tcpPCB[pcbId].tcp_accept_fn(pcbId);                                 // call the listner's accept callback
                     set_state(pcbId,ESTABLISHED);                                           // enter ESTABLISHED state and continue processing
@@ -1045,7 +1416,7 @@ static void tcp_input_handler(struct pbuf_t* const p)
                 {
                     send_rst_segment(addrLocal, portLocal, addrRemote, portRemote,          // send reset <SEQ=SEG.ACK><CTL=RST>
                                      stack_ntohl(tcp->ack), 0L,
-                                     TCP_DEF_WINDOW,
+                                     UNSCALED_WND(TCP_DEF_WINDOW),
                                      TCP_FLAG_RST);
                     return;
                 }
@@ -1077,39 +1448,79 @@ static void tcp_input_handler(struct pbuf_t* const p)
                  * prevents using old segments to update the window.
                  */
 #if DEBUG_ON
-                printf(" id %d\n SND_UNA %lu\n SEG_ACK %lu\n SND_NXT %lu\n sendTime %lu\n echoTime %lu\n",
+                printf(" id %d\n SND_UNA %lu\n SEG_ACK %lu\n SND_NXT %lu\n rtqCount %d\n",
                         pcbId,
                         tcpPCB[pcbId].SND_UNA,
                         tcpPCB[pcbId].SEG_ACK,
                         tcpPCB[pcbId].SND_NXT,
-                        tcpPCB[pcbId].sendTime,
-                        tcpPCB[pcbId].RCV_opt.echoTime);
+                        tcpPCB[pcbId].rtqCount);
+#endif
+
+#if TCP_SACK
+                if ( tcpPCB[pcbId].sackOk && tcpPCB[pcbId].RCV_opt.sackCount > 0 )
+                    newSacks = sack_mark(pcbId);                                            // mark the segments the receiver holds out of order
 #endif
 
                 if ( tcpPCB[pcbId].SND_UNA < tcpPCB[pcbId].SEG_ACK &&                       // check segment validity
                      tcpPCB[pcbId].SEG_ACK <= tcpPCB[pcbId].SND_NXT )
                 {
-                    if ( tcpPCB[pcbId].sendTime == tcpPCB[pcbId].RCV_opt.echoTime )         // first: if the send time matches the echo time stamp of queued packet
-                    {                                                                       // then this ACK is for the queued packet
-                        if ( tcpPCB[pcbId].sendLen > 0 )
-                        {                                                                   // process send buffer pointers only if ACK is for sent data/text
-                            bytes = (int) (tcpPCB[pcbId].SEG_ACK - tcpPCB[pcbId].SND_UNA);  // calculate the number of bytes that were acknowledged
-                            tcpPCB[pcbId].sendCnt -= bytes;                                 // adjust send buffer read pointer and count
-                            tcpPCB[pcbId].sendRDp += bytes;
-                            tcpPCB[pcbId].sendRDp &= CIRC_BUFFER_MASK;
-                            tcpPCB[pcbId].sendLen = 0;
-                        }
-
-                        pbuf_free(tcpPCB[pcbId].pbufQ);                                     // second: free the pbuf and
-                        tcpPCB[pcbId].sendTime = 0L;                                        // removed queued segment from retransmit queue
-                        tcpPCB[pcbId].resendTime = 0L;
-                        tcpPCB[pcbId].retranCnt = 0;
-                        tcpPCB[pcbId].pbufQ = NULL;
-
-                        tcpPCB[pcbId].SND_UNA = tcpPCB[pcbId].SEG_ACK;                      // third: now set SND.UNA <- SEG.ACK
-
-                        /* TODO calculate RTT here
-                         */
+                    bytes = rtq_ack(pcbId, tcpPCB[pcbId].SEG_ACK);                          // first: remove entirely acknowledged segments from the retransmit queue
+                    tcpPCB[pcbId].sendCnt -= bytes;                                         // second: release their send buffer bytes, bytes from a producer
+                    tcpPCB[pcbId].sendInFlight -= bytes;                                    // were never in the send buffer
+                    tcpPCB[pcbId].sendRDp += bytes;
+                    tcpPCB[pcbId].sendRDp &= CIRC_BUFFER_MASK;
+                    buf_trim(pcbId);                                                        // return chunks that were acknowledged to the pool
+
+#if TCP_CONGESTION_CTRL
+                    if ( tcpPCB[pcbId].dupAcks >= DUPACK_THRESH )                           // an ACK of new data in fast recovery
+                    {
+                        recovery_ack(pcbId, tcpPCB[pcbId].SEG_ACK - tcpPCB[pcbId].SND_UNA);
+                    }
+                    else
+                    {
+                        cwnd_update(pcbId, tcpPCB[pcbId].SEG_ACK - tcpPCB[pcbId].SND_UNA);
+                        tcpPCB[pcbId].dupAcks = 0;
+                    }
+#else
+                    tcpPCB[pcbId].dupAcks = 0;
+#endif
+                    tcpPCB[pcbId].SND_UNA = tcpPCB[pcbId].SEG_ACK;                          // third: now set SND.UNA <- SEG.ACK
+#if TCP_CONGESTION_CTRL
+                    if ( tcpPCB[pcbId].dupAcks == 0 &&                                      // after a retransmit timeout, resend the lost segments
+                         tcpPCB[pcbId].SND_UNA < tcpPCB[pcbId].recover )                    // that the congestion window allows before new data
+                        rtq_resend(pcbId);
+#endif
+                }
+
+                /* RFC 5681 section 2, a duplicate ACK acknowledges no new data while
+                 * data is outstanding, carries no data, SYN or FIN, and does not change the window.
+                 * with SACK, an ACK that SACKs new data is a duplicate even if it changes
+                 * the window (RFC 6675 section 2).
+                 * the receiver sends one for every segment after a lost one, so
+                 * a few of them mean that the oldest segment was lost
+                 */
+                else if ( tcpPCB[pcbId].SEG_ACK == tcpPCB[pcbId].SND_UNA &&
+                          tcpPCB[pcbId].rtqCount > 0 &&
+                          tcpPCB[pcbId].SEG_LEN == 0 &&
+                          (flags & (TCP_FLAG_SYN | TCP_FLAG_FIN)) == 0 &&
+                          (tcpPCB[pcbId].SEG_WND == tcpPCB[pcbId].SND_WND || newSacks > 0) )
+                {
+                    if ( tcpPCB[pcbId].dupAcks < 255 )
+                        tcpPCB[pcbId].dupAcks++;
+
+                    if ( tcpPCB[pcbId].dupAcks == DUPACK_THRESH )
+                    {
+                        fast_retransmit(pcbId);
+                    }
+                    else if ( tcpPCB[pcbId].dupAcks > DUPACK_THRESH )
+                    {
+#if TCP_CONGESTION_CTRL
+                        tcpPCB[pcbId].cwnd += SMSS;                                         // every duplicate ACK in fast recovery means a segment left
+#endif                                                                                      // the network, inflate the window to send a new one
+#if TCP_SACK
+                        if ( tcpPCB[pcbId].sackOk )
+                            sack_resend(pcbId);                                             // retransmit the next hole the receiver reported
+#endif
                     }
                 }
 
@@ -1126,9 +1537,20 @@ static void tcp_input_handler(struct pbuf_t* const p)
                         tcpPCB[pcbId].SND_WND = tcpPCB[pcbId].SEG_WND;
                         tcpPCB[pcbId].SND_WL1 = tcpPCB[pcbId].SEG_SEQ;
                         tcpPCB[pcbId].SND_WL2 = tcpPCB[pcbId].SEG_ACK;
+                        if ( tcpPCB[pcbId].SND_WND > 0 )
+                            tcpPCB[pcbId].persistCnt = 0;                                   // the window opened, restart probe back-off
                     }
                 }
 
+                /* if the ACK opened the window or made room in the retransmit queue
+                 * and the application left data in the send buffer or with a producer,
+                 * send it now instead of waiting for the next tcp_send() call, which may never come
+                 */
+                if ( tcpPCB[pcbId].state == ESTABLISHED || tcpPCB[pcbId].state == CLOSE_WAIT )
+                {
+                    send_data(pcbId);
+                }
+
                 /* If the ACK is a duplicate (SEG.ACK < SND.UNA), it can be ignored.
                  * TODO [RFC 1122, 4.2.2.20(g)] states (SEG.ACK =< SND.UNA), but I found this to not work!
                  * If the ACK acks something not yet sent (SEG.ACK > SND.NXT)
@@ -1153,9 +1575,15 @@ static void tcp_input_handler(struct pbuf_t* const p)
                         break;
 
                     case CLOSING:                                                           // TODO if the ACK acknowledges our FIN then
+#if TCP_TW_COUNT
+                        time_wait(pcbId);                                                   // enter the TIME-WAIT state and free the PCB
+                        return;
+#else
                         set_state(pcbId,TIME_WAIT);                                         // enter the TIME-WAIT state
+                        buf_free(pcbId);                                                    // the buffers are not used any more
                         // TODO otherwise ignore the segment
                         break;
+#endif
 
                     case LAST_ACK:                                                          // The only thing that can arrive in this state is an acknowledgment of our FIN
                         free_tcp_pcb(pcbId);                                                // close the connection and free resources
@@ -1173,6 +1601,28 @@ static void tcp_input_handler(struct pbuf_t* const p)
             default:;
         }
 
+        /* text and FIN are only processed in order. a segment that starts
+         * beyond RCV.NXT follows a lost segment, so its text is held in the receive
+         * buffer until the gap is filled, and an ACK for the data received so far
+         * is sent. the sender will retransmit the missing data, and the FIN
+         * that is dropped here.
+         */
+        if ( (tcpPCB[pcbId].SEG_LEN > 0 || (flags & TCP_FLAG_FIN)) &&
+             tcpPCB[pcbId].SEG_SEQ != tcpPCB[pcbId].RCV_NXT )
+        {
+#if TCP_OOQ_SPANS
+            if ( tcpPCB[pcbId].SEG_LEN > 0 &&
+                 (tcpPCB[pcbId].state == ESTABLISHED ||
+                  tcpPCB[pcbId].state == FIN_WAIT1 ||
+                  tcpPCB[pcbId].state == FIN_WAIT2) )
+            {
+                ooq_add(pcbId, ((uint8_t *)tcp) + dataOff);
+            }
+#endif
+            send_ack(pcbId);
+            return;
+        }
+
         /* TODO: sixth, check the URG bit,
          * ESTABLISHED, FIN-WAIT-1, FIN-WAIT-2
          *   If the URG bit is set, RCV.UP <- max(RCV.UP,SEG.UP), and signal
@@ -1227,17 +1677,28 @@ static void tcp_input_handler(struct pbuf_t* const p)
                         
                     if ( bytes > (int)tcpPCB[pcbId].SEG_LEN )                               // adjust count to lower number
                         bytes = (int)tcpPCB[pcbId].SEG_LEN;
-
-                    for ( i = 0; i < bytes; i++ )                                           // byte copy loop
-                    {
-                        tcpPCB[pcbId].recv[tcpPCB[pcbId].recvWRp] = dp[i];                  // copy a byte
-                        tcpPCB[pcbId].recvCnt++;
-                        tcpPCB[pcbId].recvWRp++;                                            // adjust buffer read pointer
-                        tcpPCB[pcbId].recvWRp &= CIRC_BUFFER_MASK;                          // quick way to make pointer circular
-                    }
+                    if ( bytes > (int)tcpPCB[pcbId].RCV_WND )                               // and to the window, which can be smaller than
+                        bytes = (int)tcpPCB[pcbId].RCV_WND;                                 // the free space when it is opened in large steps
+                    if ( buf_room(tcpPCB[pcbId].recv, tcpPCB[pcbId].recvWRp, (tcp_win_t) bytes, 0) < (tcp_win_t) bytes ) // drop the text if the buffer chunks ran out, part of it can't be
+                        bytes = 0;                                                          // taken because the retransmission would be a duplicate
+                    if ( bytes < (int)tcpPCB[pcbId].SEG_LEN )                               // a FIN is processed only after all the text
+                        flags &= ~TCP_FLAG_FIN;
+
+                    buf_write(tcpPCB[pcbId].recv, tcpPCB[pcbId].recvWRp, dp, (tcp_win_t) bytes); // copy bytes into the buffer
+                    tcpPCB[pcbId].recvCnt += bytes;
+                    tcpPCB[pcbId].recvWRp += bytes;                                         // adjust buffer write pointer
+                    tcpPCB[pcbId].recvWRp &= CIRC_BUFFER_MASK;                              // quick way to make pointer circular
                     
                     tcpPCB[pcbId].RCV_NXT += (uint32_t)bytes;                               // adjust next ACK parameter
-                    tcpPCB[pcbId].RCV_WND -= (uint16_t)bytes;                               // adjust windows size to space in buffer
+                    tcpPCB[pcbId].RCV_WND -= (tcp_win_t)bytes;                              // adjust windows size to space in buffer
+#if TCP_OOQ_SPANS
+                    if ( tcpPCB[pcbId].ooqCount > 0 )                                       // a gap was filled, acknowledge it
+                    {                                                                       // immediately (RFC 5681 section 4.2)
+                        ooq_merge(pcbId);                                                   // append out-of-order data that is now in order
+                        bytes = 0;
+                    }
+#endif
+                    ack_text(pcbId, (tcp_win_t) bytes);
 
                     if ( flags & TCP_FLAG_PSH )                                             // notify application of PUSH flag
                     {
@@ -1247,8 +1708,6 @@ static void tcp_input_handler(struct pbuf_t* const p)
                     {
                         send_sig(pcbId,TCP_EVENT_DATA_RECV);
                     }
-
-                    send_ack(pcbId);
                 }
                 break;
 
@@ -1294,8 +1753,13 @@ static void tcp_input_handler(struct pbuf_t* const p)
                     break;
 
                 case FIN_WAIT2:
+#if TCP_TW_COUNT
+                    time_wait(pcbId);                                                       // enter TIME-WAIT and free the PCB
+#else
                     set_state(pcbId,TIME_WAIT);                                             // enter TIME-WAIT
+                    buf_free(pcbId);                                                        // the buffers are not used any more
                     // TODO need to clear all other timers associated with this connection
+#endif
                     break;
 
                 case CLOSE_WAIT:
@@ -1313,92 +1777,281 @@ static void tcp_input_handler(struct pbuf_t* const p)
     }
 }
 
+#if TCP_HDR_PREDICT
 /*------------------------------------------------
- * find_pcb()
+ * hdr_predict()
  *
- *  this function scans the PCB list and returns a PCB ID
- *  to the PCB that matches the criteria.
+ *  the fast path of segment processing. a segment with no options or only a time stamp,
+ *  with only the ACK and PSH flags, the next sequence number and the send window already
+ *  in use is either a pure ACK of new data, or in-order text that acknowledges nothing new.
+ *  either one is processed here like the event processing of tcp_input_handler()
+ *  would for an ESTABLISHED connection that is not recovering from a loss.
+ *  any other segment is left to tcp_input_handler()
  *
- * param:  PCB state, and IP/port pais for local and remote
- * return: PCB ID, or ERR_PCB_ALLOC if not found
+ * param:  valid PCB ID with the SEG_* fields of the segment, TCP flags, TCP header length, pointer to options
+ * return: '1' if the segment was processed, '0' if not
  *
  */
-static pcbid_t find_pcb(pcb_state_t state, ip4_addr_t localIP, uint16_t localPort,
-                                           ip4_addr_t remoteIP, uint16_t remotePort)
+static int hdr_predict(pcbid_t pcbId, uint16_t flags, uint16_t dataOff, uint8_t *optList)
 {
-    int     i, done = 0, result = ERR_PCB_ALLOC;
+    uint8_t    *tsOpt = NULL;
+    uint16_t    bytes;
 
-    for (i = 0; !done && i < TCP_PCB_COUNT; i++)                    // scan PCB list
+    /* a time stamp option is predicted in the layout of RFC 7323 appendix A, <NOP><NOP><TS>,
+     * or with two bytes of padding after it as this stack sends it
+     */
+    if ( dataOff == 32 )
     {
-        switch ( state )
-        {
-            case FREE:                                              // find FREE (empty) PCBs
-                result = i;
-                done = 1;
-                break;
+        if ( optList[0] == 1 && optList[1] == 1 && optList[2] == 8 && optList[3] == 10 )
+            tsOpt = &optList[4];
+        else if ( optList[0] == 8 && optList[1] == 10 && optList[10] <= 1 && optList[11] <= 1 )
+            tsOpt = &optList[2];
+        else
+            return 0;
+    }
+    else if ( dataOff != 20 )
+        return 0;
 
-            case ANY_STATE:
-                {
-                    if ( tcpPCB[i].localIP == localIP &&            // match only local and remote IP/port
-                         tcpPCB[i].localPort == localPort &&
-                         tcpPCB[i].remoteIP == remoteIP &&
-                         tcpPCB[i].remotePort == remotePort)
-                    {
-                        result = i;
-                        done = 1;
-                    }
-                }
-                break;
+    if ( tcpPCB[pcbId].state != ESTABLISHED ||
+         (flags & ~TCP_FLAG_PSH) != TCP_FLAG_ACK ||                                         // no SYN, FIN, RST or URG
+         tcpPCB[pcbId].SEG_SEQ != tcpPCB[pcbId].RCV_NXT ||                                  // next in order
+         tcpPCB[pcbId].SEG_WND != tcpPCB[pcbId].SND_WND ||                                  // no window update
+         tcpPCB[pcbId].SEG_ACK > tcpPCB[pcbId].SND_NXT ||
+         tcpPCB[pcbId].dupAcks != 0 )                                                       // not in fast recovery
+        return 0;
 
-            case BOUND:
-            case LISTEN:
-                if ( tcpPCB[i].state == state &&                    // if searching for a bound or listening PCB
-                     tcpPCB[i].localIP == localIP &&                // only local IP/port matches are needed
-                     tcpPCB[i].localPort == localPort )
-                {
-                    result = i;
-                    done = 1;
-                }
-                break;
+    if ( tcpPCB[pcbId].SEG_LEN == 0 )
+    {
+        /* a pure ACK of new data, not needed to resend data after
+         * a retransmit timeout
+         */
+        if ( tcpPCB[pcbId].SEG_ACK <= tcpPCB[pcbId].SND_UNA )
+            return 0;
+#if TCP_CONGESTION_CTRL
+        if ( tcpPCB[pcbId].SEG_ACK < tcpPCB[pcbId].recover )
+            return 0;
+#endif
 
-            default:
-                {
-                    if ( tcpPCB[i].state == state &&                // for all other PCB states
-                         tcpPCB[i].localIP == localIP &&            // match both local and remote IP/port
-                         tcpPCB[i].localPort == localPort &&
-                         tcpPCB[i].remoteIP == remoteIP &&
-                         tcpPCB[i].remotePort == remotePort)
-                    {
-                        result = i;
-                        done = 1;
-                    }
-                }
-        }
+        bytes = rtq_ack(pcbId, tcpPCB[pcbId].SEG_ACK);                                      // remove acknowledged segments and release their send buffer bytes
+        tcpPCB[pcbId].sendCnt -= bytes;
+        tcpPCB[pcbId].sendInFlight -= bytes;
+        tcpPCB[pcbId].sendRDp += bytes;
+        tcpPCB[pcbId].sendRDp &= CIRC_BUFFER_MASK;
+        buf_trim(pcbId);
+#if TCP_CONGESTION_CTRL
+        cwnd_update(pcbId, tcpPCB[pcbId].SEG_ACK - tcpPCB[pcbId].SND_UNA);
+#endif
+        tcpPCB[pcbId].SND_UNA = tcpPCB[pcbId].SEG_ACK;
+    }
+    else
+    {
+        /* in-order text that fits in the receive window and buffer,
+         * with no out-of-order text waiting to be merged
+         */
+        if ( tcpPCB[pcbId].SEG_ACK != tcpPCB[pcbId].SND_UNA ||
+             tcpPCB[pcbId].SEG_LEN > tcpPCB[pcbId].RCV_WND ||
+             tcpPCB[pcbId].SEG_LEN > (TCP_DATA_BUF_SIZE - tcpPCB[pcbId].recvCnt) )
+            return 0;
+#if TCP_OOQ_SPANS
+        if ( tcpPCB[pcbId].ooqCount > 0 )
+            return 0;
+#endif
+        bytes = tcpPCB[pcbId].SEG_LEN;
+        if ( buf_room(tcpPCB[pcbId].recv, tcpPCB[pcbId].recvWRp, (tcp_win_t) bytes, 0) < (tcp_win_t) bytes )
+            return 0;
+
+        buf_write(tcpPCB[pcbId].recv, tcpPCB[pcbId].recvWRp, optList + (dataOff - 20), (tcp_win_t) bytes); // copy bytes into the buffer
+        tcpPCB[pcbId].recvCnt += bytes;
+        tcpPCB[pcbId].recvWRp += bytes;
+        tcpPCB[pcbId].recvWRp &= CIRC_BUFFER_MASK;
+        tcpPCB[pcbId].RCV_NXT += (uint32_t)bytes;
+        tcpPCB[pcbId].RCV_WND -= (tcp_win_t)bytes;
     }
 
-    return result;
-}
+    if ( tsOpt != NULL )
+    {
+        tcpPCB[pcbId].RCV_opt.time = stack_ntohl(*((uint32_t*)tsOpt));
+        tcpPCB[pcbId].RCV_opt.echoTime = stack_ntohl(*((uint32_t*)(tsOpt + 4)));
+    }
 
-/*------------------------------------------------
- * send_segment()
- *
- *  this function send a TCP segment and flags.
- *
- * param:  PCB ID to use for transmit, segment flags
- * return: ERR_OK if no errors or ip4_err_t with error code
- *
+    if ( tcpPCB[pcbId].SND_WL1 < tcpPCB[pcbId].SEG_SEQ ||                                  // RFC 1122, 4.2.2.20(g), the window is
+         (tcpPCB[pcbId].SND_WL1 == tcpPCB[pcbId].SEG_SEQ &&                                 // unchanged but the segment is newer
+          tcpPCB[pcbId].SND_WL2 <= tcpPCB[pcbId].SEG_ACK) )
+    {
+        tcpPCB[pcbId].SND_WL1 = tcpPCB[pcbId].SEG_SEQ;
+        tcpPCB[pcbId].SND_WL2 = tcpPCB[pcbId].SEG_ACK;
+    }
+
+    if ( tcpPCB[pcbId].SEG_LEN == 0 )
+    {
+        send_data(pcbId);                                                                   // the ACK made room for more data
+    }
+    else
+    {
+        ack_text(pcbId, bytes);                                                             // before the signal, a reply may carry the ACK
+        send_sig(pcbId, (flags & TCP_FLAG_PSH) ? TCP_EVENT_PUSH : TCP_EVENT_DATA_RECV);
+    }
+
+    return 1;
+}
+#endif
+
+/*------------------------------------------------
+ * find_pcb()
+ *
+ *  this function looks up a PCB that matches the criteria.
+ *  connected PCBs are found by their local and remote IP/port in the
+ *  connection hash table, and LISTENing PCBs by their local IP/port in the
+ *  listener table.
+ *
+ * param:  PCB state ANY_STATE or LISTEN, and IP/port pais for local and remote
+ * return: PCB ID, or ERR_PCB_ALLOC if not found
+ *
+ */
+static pcbid_t find_pcb(pcb_state_t state, ip4_addr_t localIP, uint16_t localPort,
+                                           ip4_addr_t remoteIP, uint16_t remotePort)
+{
+    pcbid_t     pcbId;
+    int         i;
+
+    if ( state == ANY_STATE )
+    {
+        i = (int) ((uint16_t) remoteIP ^ (uint16_t) (remoteIP >> 16) ^ remotePort ^ localPort) & PCB_HASH_MASK;
+        while ( (pcbId = pcbHash[i]) != NO_PCB )                    // probe until an empty slot
+        {
+            if ( tcpPCB[pcbId].localIP == localIP &&                // match local and remote IP/port
+                 tcpPCB[pcbId].localPort == localPort &&
+                 tcpPCB[pcbId].remoteIP == remoteIP &&
+                 tcpPCB[pcbId].remotePort == remotePort )
+                return pcbId;
+            i = (i + 1) & PCB_HASH_MASK;
+        }
+    }
+    else if ( state == LISTEN )
+    {
+        for (i = 0; i < TCP_SERVER_COUNT; i++)
+        {
+            pcbId = listenPcb[i];
+            if ( pcbId != NO_PCB &&                                 // only local IP/port matches are needed
+                 tcpPCB[pcbId].localIP == localIP &&
+                 tcpPCB[pcbId].localPort == localPort )
+                return pcbId;
+        }
+    }
+
+    return ERR_PCB_ALLOC;
+}
+
+/*------------------------------------------------
+ * pcb_hash_add()
+ *
+ *  add a PCB to the connection hash table after its
+ *  remote IP/port were set
+ *
+ * param:  PCB ID
+ * return: none
+ *
+ */
+static void pcb_hash_add(pcbid_t pcbId)
+{
+    int     i;
+
+    i = pcb_hash(pcbId);
+    while ( pcbHash[i] != NO_PCB )                                  // the table has more slots than PCBs,
+        i = (i + 1) & PCB_HASH_MASK;                                // so an empty slot is always found
+    pcbHash[i] = pcbId;
+}
+
+/*------------------------------------------------
+ * pcb_hash_remove()
+ *
+ *  remove a PCB from the connection hash table, if it is there.
+ *  the PCBs that follow it in the probe sequence are moved back
+ *  into the empty slot when their home slot allows it, so that lookups
+ *  always end at an empty slot and no deleted-slot markers are needed.
+ *
+ * param:  PCB ID
+ * return: none
+ *
+ */
+static void pcb_hash_remove(pcbid_t pcbId)
+{
+    int     i, j, home;
+
+    i = pcb_hash(pcbId);
+    while ( pcbHash[i] != pcbId )
+    {
+        if ( pcbHash[i] == NO_PCB )                                 // not in the table
+            return;
+        i = (i + 1) & PCB_HASH_MASK;
+    }
+    pcbHash[i] = NO_PCB;
+
+    j = i;
+    for (;;)
+    {
+        j = (j + 1) & PCB_HASH_MASK;
+        if ( pcbHash[j] == NO_PCB )
+            break;
+
+        home = pcb_hash(pcbHash[j]);
+        if ( (j > i && (home <= i || home > j)) ||                  // move back unless the home slot is
+             (j < i && (home <= i && home > j)) )                   // cyclically between the empty slot and this one
+        {
+            pcbHash[i] = pcbHash[j];
+            pcbHash[j] = NO_PCB;
+            i = j;
+        }
+    }
+}
+
+/*------------------------------------------------
+ * pcb_take()
+ *
+ *  remove a FREE PCB from the free PCB stack when it is put to use.
+ *  this is usually the PCB on top, that tcp_new() returned.
+ *
+ * param:  PCB ID
+ * return: none
+ *
+ */
+static void pcb_take(pcbid_t pcbId)
+{
+    int     i;
+
+    for (i = freePcbs - 1; i >= 0; i--)
+    {
+        if ( freePcb[i] == pcbId )
+        {
+            freePcbs--;
+            freePcb[i] = freePcb[freePcbs];
+            return;
+        }
+    }
+}
+
+/*------------------------------------------------
+ * send_segment()
+ *
+ *  this function send a TCP segment and flags.
+ *
+ * param:  PCB ID to use for transmit, segment flags
+ * return: ERR_OK if no errors or ip4_err_t with error code
+ *
  */
 static ip4_err_t send_segment(pcbid_t pcbId, uint16_t flags)
 {
     ip4_err_t           result = ERR_OK;
     uint16_t            checksumTemp = 0;
-    uint32_t            pseudoHdrSum;
-    uint16_t            bytes, i, j, sendCount = 0;
+    uint32_t            pseudoHdrSum, pending, textSum = 0;
+    uint16_t            bytes, sendCount = 0, bufCount = 0, sackBytes = 0, sumFrom = 0;
+    tcp_win_t           j;
     struct pbuf_t      *p;
     struct tcp_t       *tcp;
     struct syn_opt_t   *synOpt;
     struct opt_t       *opt;
     uint8_t            *text;
+    struct net_interface_t *netif = NULL;
 
 #if DEBUG_ON
     printf("-> %s()\n", __func__);
@@ -1409,14 +2062,28 @@ static ip4_err_t send_segment(pcbid_t pcbId, uint16_t flags)
         return ERR_MEM;
 
     /* prepare some common TCP segment content
-     * that will be used in all segment transmissions
+     * that will be used in all segment transmissions.
+     * segments other than SYN start from the connection's header template
      */
     tcp = (struct tcp_t*) &(p->pbuf[FRAME_HDR_LEN + IP_HDR_LEN]);                       // pointer to TCP header
-    tcp->srcPort = stack_hton(tcpPCB[pcbId].localPort);                                 // populate TCP header with common elements
-    tcp->destPort = stack_hton(tcpPCB[pcbId].remotePort);
-    tcp->window = stack_hton(tcpPCB[pcbId].RCV_WND);
+#if TCP_HDR_TEMPLATE
+    if ( !(flags & TCP_FLAG_SYN) &&
+         (netif = hdr_template(pcbId)) != NULL )
+    {
+        memcpy(p->pbuf, tcpPCB[pcbId].tmpl, TCP_TMPL_LEN);                              // frame and IP headers, ports and urgent pointer
+    }
+    else
+#endif
+    {
+        tcp->srcPort = stack_hton(tcpPCB[pcbId].localPort);                             // populate TCP header with common elements
+        tcp->destPort = stack_hton(tcpPCB[pcbId].remotePort);
+        tcp->urgentPtr = stack_hton(tcpPCB[pcbId].SND_UP);
+    }
+    if ( flags & TCP_FLAG_SYN )
+        tcp->window = stack_hton(UNSCALED_WND(tcpPCB[pcbId].RCV_WND));                  // the window in a SYN is never scaled
+    else
+        tcp->window = stack_hton(ADV_WND(pcbId));
     tcp->checksum = 0;
-    tcp->urgentPtr = stack_hton(tcpPCB[pcbId].SND_UP);
 
     tcpPCB[pcbId].SND_opt.time = stack_time();                                          // set this up here, this is a common point for all 'send's
 
@@ -1434,19 +2101,34 @@ static ip4_err_t send_segment(pcbid_t pcbId, uint16_t flags)
             tcpPCB[pcbId].sendCnt);
 #endif
 
-    bytes = tcpPCB[pcbId].sendCnt;
-    if ( bytes > (MSS - OPT_BYTES) )                                                    // fit bytes into max segment size
-        bytes = (MSS - OPT_BYTES);
-    if ( bytes > tcpPCB[pcbId].SND_WND )                                                // fit bytes to send into available window
-        bytes = tcpPCB[pcbId].SND_WND;
+#if TCP_SACK && TCP_OOQ_SPANS
+    if ( tcpPCB[pcbId].sackOk &&                                                        // report out-of-order data held by the receiver
+         tcpPCB[pcbId].ooqCount > 0 &&                                                  // in SACK blocks after the time stamp option
+         (flags & (TCP_FLAG_SYN | TCP_FLAG_ACK)) == TCP_FLAG_ACK )
+    {
+        if ( tcpPCB[pcbId].ooqCount < TCP_SACK_BLOCKS )
+            sackBytes = tcpPCB[pcbId].ooqCount * sizeof(struct tcp_span_t);
+        else
+            sackBytes = TCP_SACK_BLOCKS * sizeof(struct tcp_span_t);
+    }
+#endif
+
+    pending = unsent_bytes(pcbId);
+    bytes = segment_bytes(pcbId, SMSS - sackBytes);                                     // fit bytes into max segment size and available window
 
     if ( ( bytes > 0 || (flags & ~TCP_FLAG_ACK) ) &&                                    // if there is data to send or a control flag other than ACK
-         tcpPCB[pcbId].pbufQ != NULL )                                                  // and the queue is in use
+         ( tcpPCB[pcbId].rtqCount == TCP_MAX_INFLIGHT || rtqBufs >= TCP_RTQ_BUFS ) )    // and the queue is full
     {
         pbuf_free(p);
         return ERR_TCP_WACK;                                                            // exit here
     }
 
+    if ( (flags & TCP_FLAG_FIN) && pending > (uint32_t) bytes )                         // a FIN is sent only after all data
+    {
+        pbuf_free(p);
+        return ERR_TCP_WACK;
+    }
+
     /* at this point we know we can queue a segment if we need to
      * or that we can send one if the queue is in use but the segment
      * does not need queuing. special handling for queuing ACK segments
@@ -1454,7 +2136,13 @@ static ip4_err_t send_segment(pcbid_t pcbId, uint16_t flags)
      */
     tcp->seq = stack_htonl(tcpPCB[pcbId].SND_NXT);
     if ( flags & TCP_FLAG_ACK )
+    {
         tcp->ack = stack_htonl(tcpPCB[pcbId].RCV_NXT);
+        tcpPCB[pcbId].rcvAdv = tcpPCB[pcbId].RCV_NXT + tcpPCB[pcbId].RCV_WND;          // the segment tells the peer the window it may send to
+#if TCP_DELAYED_ACK
+        tcpPCB[pcbId].ackPending = 0;                                                   // and acknowledges all the text received
+#endif
+    }
     else
         tcp->ack = 0;
 
@@ -1470,9 +2158,35 @@ static ip4_err_t send_segment(pcbid_t pcbId, uint16_t flags)
         synOpt->tsOptLen = 10;
         synOpt->tsTime = stack_htonl(tcpPCB[pcbId].SND_opt.time);
         synOpt->tsEcho = stack_htonl(tcpPCB[pcbId].RCV_opt.time);
-        synOpt->endOfOpt = 0;                                                           // padding
+#if TCP_SACK
+        if ( !(flags & TCP_FLAG_ACK) || tcpPCB[pcbId].sackOk )                          // SACK permitted in a SYN, or a SYN+ACK to a client that permitted it
+        {
+            synOpt->sackPermOpt = 4;
+            synOpt->sackPermOptLen = 2;
+        }
+        else
+#endif
+        {
+            synOpt->sackPermOpt = 1;                                                    // padding
+            synOpt->sackPermOptLen = 1;
+        }
+#if TCP_WIN_SCALE
+        synOpt->nopOpt = 1;
+        if ( tcpPCB[pcbId].SND_opt.winScale != TCP_WSCALE_NONE )                         // window scale in a SYN, or a SYN+ACK to a client that offered it
+        {
+            synOpt->wsOpt = 3;
+            synOpt->wsOptLen = 3;
+            synOpt->wsShift = tcpPCB[pcbId].SND_opt.winScale;
+        }
+        else
+        {
+            synOpt->wsOpt = 1;                                                          // padding
+            synOpt->wsOptLen = 1;
+            synOpt->wsShift = 1;
+        }
+#endif
 
-        pseudoHdrSum = pseudo_header_sum(tcpPCB[pcbId].localIP, tcpPCB[pcbId].remoteIP, TCP_HDR_LEN + SYN_OPT_BYTES); // calculate pseudo-header checksum
+        pseudoHdrSum = ip4_pseudo_sum(tcpPCB[pcbId].localIP, tcpPCB[pcbId].remoteIP, IP4_TCP, TCP_HDR_LEN + SYN_OPT_BYTES); // calculate pseudo-header checksum
         checksumTemp = stack_checksumEx(tcp, TCP_HDR_LEN + SYN_OPT_BYTES, pseudoHdrSum);
         tcp->checksum = ~checksumTemp;
 
@@ -1481,14 +2195,26 @@ static ip4_err_t send_segment(pcbid_t pcbId, uint16_t flags)
     }
     else
     {
-        tcp->dataOffsAndFlags = stack_hton((OPT_LEN<<12) + flags);                      // options without MSS only time-stamp with flags
+        tcp->dataOffsAndFlags = stack_hton(((OPT_LEN + sackBytes / 4)<<12) + flags);    // options without MSS only time-stamp and SACK with flags
 
         opt = (struct opt_t*) &(tcp->payloadStart);                                     // setup options
         opt->tsOpt = 8;                                                                 // time stamp
         opt->tsOptLen = 10;
         opt->tsTime = stack_htonl(tcpPCB[pcbId].SND_opt.time);
         opt->tsEcho = stack_htonl(tcpPCB[pcbId].RCV_opt.time);
-        opt->endOfOpt = 0;                                                              // padding
+#if TCP_SACK && TCP_OOQ_SPANS
+        if ( sackBytes > 0 )
+        {
+            opt->sackOpt = 5;                                                           // SACK
+            opt->sackOptLen = 2 + sackBytes;
+            sack_blocks(pcbId, (struct tcp_span_t*) ((uint8_t*)opt + OPT_BYTES), sackBytes / sizeof(struct tcp_span_t));
+        }
+        else
+#endif
+        {
+            opt->sackOpt = 0;                                                           // padding
+            opt->sackOptLen = 0;
+        }
 
         /* if PCB is in ESTABLISHED or CLOSE_WAIT states and
          * send window is greater than 0 and there is data to send
@@ -1497,63 +2223,1065 @@ static ip4_err_t send_segment(pcbid_t pcbId, uint16_t flags)
         if ( (tcpPCB[pcbId].state == ESTABLISHED || tcpPCB[pcbId].state == CLOSE_WAIT) &&
               bytes > 0 )                                                               // 'bytes' already accounts for MSS and current window size
         {
-            text = (uint8_t*)opt + OPT_BYTES;                                           // pointer to data
-
-            j = tcpPCB[pcbId].sendRDp;                                                  // copy but don't move the pointer until this segment is Ack'd
-            for ( i = 0; i < bytes; i++ )                                               // copy bytes to send into the segment
-            {
-                text[i] = tcpPCB[pcbId].send[j];                                        // copy data bytes
-                j++;
-                j &= CIRC_BUFFER_MASK;                                                  // quick way to make pointer circular
-            }
-            sendCount = bytes;                                                          // adjust for segment size calculations
-            tcpPCB[pcbId].sendLen = bytes;
-            flags |= TCP_FLAG_PSH;                                                      // TODO: always push
+            text = (uint8_t*)opt + OPT_BYTES + sackBytes;                               // pointer to data
+
+            sendCount = bytes;                                                          // send buffer data goes first
+            if ( sendCount > (tcpPCB[pcbId].sendCnt - tcpPCB[pcbId].sendInFlight) )
+                sendCount = tcpPCB[pcbId].sendCnt - tcpPCB[pcbId].sendInFlight;
+
+            j = tcpPCB[pcbId].sendRDp + tcpPCB[pcbId].sendInFlight;                     // copy from the first byte not sent, but don't move the read pointer
+            j &= CIRC_BUFFER_MASK;                                                      // until the segment is Ack'd
+            if ( has_sum_hint(pcbId, tcpPCB[pcbId].SND_NXT, sendCount) )
+            {
+                buf_read(tcpPCB[pcbId].send, j, text, sendCount, NULL);                 // data of tcp_send_sum() uses its precomputed checksum
+            }
+            else
+            {
+                buf_read(tcpPCB[pcbId].send, j, text, sendCount, &textSum);             // sum the bytes while copying them into the segment
+                sumFrom = sendCount;
+            }
+            bufCount = sendCount;
+            tcpPCB[pcbId].sendInFlight += bufCount;
+
+            if ( sendCount < bytes )                                                    // the producer writes the rest in place
+                sendCount += produce_data(pcbId, &text[sendCount], tcpPCB[pcbId].SND_NXT + sendCount, bytes - sendCount);
+            flags |= TCP_FLAG_PSH;                                                      // TODO: always push
+#if TCP_NAGLE
+            if ( sendCount < (SMSS - sackBytes) &&
+                 sendCount < (tcpPCB[pcbId].SND_WND / 2) )
+                tcpPCB[pcbId].smallEnd = tcpPCB[pcbId].SND_NXT + sendCount;             // a small segment is now waiting for an ACK
+#endif
+        }
+
+#if TCP_HDR_TEMPLATE
+        if ( netif )
+            pseudoHdrSum = tcpPCB[pcbId].tmplSum + TCP_HDR_LEN + OPT_BYTES + sackBytes + sendCount; // the template's sum and the segment length
+        else
+#endif
+        pseudoHdrSum = ip4_pseudo_sum(tcpPCB[pcbId].localIP, tcpPCB[pcbId].remoteIP, IP4_TCP, TCP_HDR_LEN + OPT_BYTES + sackBytes + sendCount); // calculate pseudo-header checksum
+        pseudoHdrSum += textSum;                                                        // add payload sum, header is an even length so the payload is word aligned
+        if ( sendCount > sumFrom )
+            pseudoHdrSum += payload_sum(pcbId, (uint8_t*)opt + OPT_BYTES + sackBytes, tcpPCB[pcbId].SND_NXT, sumFrom, sendCount); // and the sum of payload that was not summed while copied
+#if TCP_HDR_TEMPLATE
+        if ( netif )
+        {
+            checksumTemp = stack_checksumEx(opt, OPT_BYTES + sackBytes, pseudoHdrSum);                  // sum the options
+            checksumTemp = stack_checksumEx(&(tcp->seq), TCP_HDR_LEN - 8, stack_ntoh(checksumTemp));    // and only the header fields that are not in the template
+        }
+        else
+#endif
+        checksumTemp = stack_checksumEx(tcp, TCP_HDR_LEN + OPT_BYTES + sackBytes, pseudoHdrSum);
+        tcp->checksum = ~checksumTemp;
+
+        p->len = FRAME_HDR_LEN + IP_HDR_LEN + TCP_HDR_LEN + OPT_BYTES + sackBytes + sendCount; // set packet length
+        if ( flags & TCP_FLAG_FIN )                                                     // optional count of FIN signal
+            sendCount++;
+    }
+
+    /* after sending the segment check if it needs to be queued.
+     * only queue segments that have a control flag other than ACK,
+     * such as SYN or FIN, or segments that carry data.
+     * a segment with only an ACK and not data (length == 0) will not be queued.
+     * such a segment will be transmitted and the pbuf is freed.
+     */
+#if TCP_HDR_TEMPLATE
+    if ( netif )
+        result = ip4_output_prebuilt(netif, p);                                         // transmit the TCP segment with the template's headers
+    else
+#endif
+    result = ip4_output(tcpPCB[pcbId].remoteIP, IP4_TCP, p);                            // transmit the TCP segment
+
+    if ( (flags & (TCP_FLAG_FIN + TCP_FLAG_SYN)) ||                                     // only queue segments that need to be acknowledged
+          sendCount > 0 )                                                               // ones that have control flags other than ACK or contain data
+    {
+        rtq_add(pcbId, p, tcpPCB[pcbId].SND_NXT, sendCount, bufCount);                  // queue the segment
+    }
+    else
+    {
+        pbuf_free(p);                                                                   // free the pbuf if no queuing is needed
+    }
+
+    tcpPCB[pcbId].SND_NXT += sendCount;                                                 // adjust the send next count
+
+#if DEBUG_ON
+    printf("<- %s() %d\n", __func__, result);
+#endif
+
+    return result;
+}
+
+/*------------------------------------------------
+ * ack_text()
+ *
+ *  acknowledge text received in order. with TCP_DELAYED_ACK the ACK of a segment
+ *  is delayed (RFC 1122 4.2.3.2) so it can be sent with the application's reply
+ *  or with the ACK of the next segment; every second segment is acknowledged immediately.
+ *  the ACK is not delayed if the window last advertised does not leave room for another
+ *  segment like this one, the sender would have to wait for the delayed ACK.
+ *  tcp_timeout_handler() sends the ACK if TCP_ACK_DELAY expires.
+ *
+ * param:  PCB ID, byte count of the segment's text or '0' to acknowledge immediately
+ * return: none
+ *
+ */
+static void ack_text(pcbid_t pcbId, tcp_win_t bytes)
+{
+#if TCP_DELAYED_ACK
+    if ( !tcpPCB[pcbId].ackPending &&
+         bytes > 0 &&
+         tcpPCB[pcbId].rcvAdv >= (tcpPCB[pcbId].RCV_NXT + bytes) )
+    {
+        tcpPCB[pcbId].ackPending = 1;
+        tcpPCB[pcbId].ackTime = stack_time();
+        return;
+    }
+#endif
+    send_ack(pcbId);
+}
+
+/*------------------------------------------------
+ * send_probe()
+ *
+ *  send a zero window probe. the probe is an ACK segment with the sequence number
+ *  SND.UNA-1 and no data, which the peer finds not acceptable and answers with an
+ *  ACK that carries its current window (RFC 793 section 3.9).
+ *  the probe is not queued for retransmission, so the retransmit limit
+ *  does not close a connection whose peer keeps its window closed.
+ *
+ * param:  PCB ID, with no data in flight
+ * return: none
+ *
+ */
+static void send_probe(pcbid_t pcbId)
+{
+    tcpPCB[pcbId].SND_UNA--;                                                            // move the usable window one byte back
+    tcpPCB[pcbId].SND_NXT--;                                                            // so the ACK carries no data
+    send_ack(pcbId);
+    tcpPCB[pcbId].SND_UNA++;
+    tcpPCB[pcbId].SND_NXT++;
+}
+
+/*------------------------------------------------
+ * send_data()
+ *
+ *  send the data waiting in the send buffer or with a producer, in as many
+ *  segments as the send window and the retransmit queue allow.
+ *
+ * param:  PCB ID to use for transmit
+ * return: none
+ *
+ */
+static void send_data(pcbid_t pcbId)
+{
+    uint32_t    seq;
+
+#if TCP_CONGESTION_CTRL
+    /* RFC 5681 section 4.1, restart from the initial window after
+     * being idle for longer than the retransmit timeout
+     */
+    if ( tcpPCB[pcbId].rtqCount == 0 &&
+         tcpPCB[pcbId].cwnd > INIT_CWND &&
+         (stack_time() - tcpPCB[pcbId].resendTime) > tcpPCB[pcbId].RT0 )
+        tcpPCB[pcbId].cwnd = INIT_CWND;
+#endif
+
+    while ( segment_bytes(pcbId, SMSS) > 0 )
+    {
+        seq = tcpPCB[pcbId].SND_NXT;
+        if ( send_segment(pcbId, TCP_FLAG_PSH + TCP_FLAG_ACK) != ERR_OK ||              // stop if the queue is full or output failed
+             tcpPCB[pcbId].SND_NXT == seq )                                             // or if no data could be sent
+            break;
+    }
+}
+
+/*------------------------------------------------
+ * unsent_bytes()
+ *
+ *  count the data bytes that are waiting to be sent for the first time
+ *
+ * param:  PCB ID
+ * return: byte count in the send buffer and with a producer that were not sent
+ *
+ */
+static uint32_t unsent_bytes(pcbid_t pcbId)
+{
+    uint32_t    bytes;
+
+    bytes = (uint32_t) (tcpPCB[pcbId].sendCnt - tcpPCB[pcbId].sendInFlight);
+    if ( tcpPCB[pcbId].producer != NULL )                                               // add data a producer has yet to write
+        bytes += tcpPCB[pcbId].prodLen - tcpPCB[pcbId].prodOffset;
+
+    return bytes;
+}
+
+/*------------------------------------------------
+ * segment_bytes()
+ *
+ *  the data byte count of the next segment, limited by the segment size,
+ *  the usable send window and the data waiting to be sent.
+ *  with TCP_NAGLE a segment smaller than the segment size is only sent (RFC 1122 4.2.3.4):
+ *  - if the connection is set with tcp_nodelay()
+ *  - if it takes at least half of the peer's window, a window smaller than
+ *    a segment would otherwise only allow small segments
+ *  - if it carries all the data, the data is pushed and no other small segment
+ *    waits for an ACK, Minshall's version of Nagle's algorithm that does not
+ *    delay the end of a response behind the peer's delayed ACK
+ *  otherwise the data waits for the ACK or for more data.
+ *
+ * param:  PCB ID, segment size
+ * return: byte count of the next segment, '0' if nothing can be sent
+ *
+ */
+static uint16_t segment_bytes(pcbid_t pcbId, uint16_t maxSeg)
+{
+    uint32_t    pending;
+    tcp_win_t   window;
+    uint16_t    bytes;
+
+    pending = unsent_bytes(pcbId);
+    window = send_window(pcbId);
+
+    bytes = maxSeg;
+    if ( bytes > window )
+        bytes = (uint16_t) window;
+    if ( (uint32_t) bytes > pending )
+        bytes = (uint16_t) pending;
+
+#if TCP_NAGLE
+    if ( bytes == 0 || bytes == maxSeg || tcpPCB[pcbId].noDelay ||
+         bytes >= (tcpPCB[pcbId].SND_WND / 2) )
+        return bytes;
+
+    if ( (uint32_t) bytes < pending ||                                                  // the window is the limit, wait for the ACK that opens it
+         tcpPCB[pcbId].pushEnd <= tcpPCB[pcbId].SND_NXT ||                              // or no pushed data to send
+         tcpPCB[pcbId].smallEnd > tcpPCB[pcbId].SND_UNA )                               // or a small segment waits for an ACK
+        return 0;
+#endif
+
+    return bytes;
+}
+
+/*------------------------------------------------
+ * send_window()
+ *
+ *  the usable send window, which is the part of the peer's window,
+ *  or of the congestion window if it is smaller, that is not taken
+ *  by segments waiting for an ACK.
+ *
+ * param:  PCB ID
+ * return: byte count that can be sent
+ *
+ */
+static tcp_win_t send_window(pcbid_t pcbId)
+{
+    uint32_t    edge;
+
+    edge = tcpPCB[pcbId].SND_WND;
+#if TCP_CONGESTION_CTRL
+    if ( edge > tcpPCB[pcbId].cwnd )
+        edge = tcpPCB[pcbId].cwnd;
+#endif
+    edge += tcpPCB[pcbId].SND_UNA;                                                      // right edge of the usable window
+    if ( edge > tcpPCB[pcbId].SND_NXT )
+        return (tcp_win_t) (edge - tcpPCB[pcbId].SND_NXT);
+
+    return 0;
+}
+
+/*------------------------------------------------
+ * rtq_add()
+ *
+ *  add a sent segment to the tail of the retransmit queue.
+ *  the retransmit timer starts if the queue was empty.
+ *
+ * param:  PCB ID, segment pbuf, segment sequence number, sequence space length,
+ *         data byte count that came from the send buffer
+ * return: none
+ *
+ */
+static void rtq_add(pcbid_t pcbId, struct pbuf_t *p, uint32_t seq, uint16_t len, uint16_t bufLen)
+{
+    struct tcp_rtq_t   *entry;
+    uint8_t             tail;
+
+    if ( tcpPCB[pcbId].rtqCount == 0 )
+    {
+        tcpPCB[pcbId].resendTime = tcpPCB[pcbId].SND_opt.time;                          // time stamp for retransmit calculations
+        tcpPCB[pcbId].retranCnt = 0;                                                    // retransmit count
+    }
+
+    tail = tcpPCB[pcbId].rtqHead + tcpPCB[pcbId].rtqCount;
+    if ( tail >= TCP_MAX_INFLIGHT )
+        tail -= TCP_MAX_INFLIGHT;
+
+    entry = &(tcpPCB[pcbId].rtq[tail]);
+    entry->pbuf = p;
+    entry->seq = seq;
+    entry->len = len;
+    entry->bufLen = bufLen;
+    entry->sendTime = tcpPCB[pcbId].SND_opt.time;
+#if TCP_SACK
+    entry->sacked = 0;
+#endif
+
+    tcpPCB[pcbId].rtqCount++;
+    rtqBufs++;
+}
+
+/*------------------------------------------------
+ * rtq_ack()
+ *
+ *  remove the segments that an ACK acknowledges entirely from the head of the
+ *  retransmit queue. a segment that is only partly acknowledged stays queued.
+ *  the newest removed segment provides an RTT measurement, unless it or
+ *  a segment before it was retransmitted (Karn's algorithm), because
+ *  the ACK may have been sent for the retransmission.
+ *  the retransmit timer restarts if segments are removed and others are still
+ *  waiting for an ACK (RFC 6298 section 5.3).
+ *
+ * param:  PCB ID, acknowledgment number
+ * return: byte count of removed segments' data that came from the send buffer
+ *
+ */
+static uint16_t rtq_ack(pcbid_t pcbId, uint32_t ack)
+{
+    struct tcp_rtq_t   *entry;
+    uint16_t            bytes = 0;
+    uint32_t            sendTime = 0, now;
+    int                 removed = 0;
+
+    while ( tcpPCB[pcbId].rtqCount > 0 )
+    {
+        entry = &(tcpPCB[pcbId].rtq[tcpPCB[pcbId].rtqHead]);
+        if ( (entry->seq + entry->len) > ack )                                          // stop at the first segment not entirely acknowledged
+            break;
+
+        bytes += entry->bufLen;
+        if ( removed == 0 || sendTime != 0 )                                            // no measurement after a retransmitted segment
+            sendTime = entry->sendTime;
+        pbuf_free(entry->pbuf);
+        entry->pbuf = NULL;
+        rtqBufs--;
+        removed++;
+
+        tcpPCB[pcbId].rtqHead++;
+        if ( tcpPCB[pcbId].rtqHead == TCP_MAX_INFLIGHT )
+            tcpPCB[pcbId].rtqHead = 0;
+        tcpPCB[pcbId].rtqCount--;
+    }
+
+    if ( removed )
+    {
+        now = stack_time();
+        if ( sendTime != 0 )
+            rto_update(pcbId, now - sendTime);
+        tcpPCB[pcbId].resendTime = now;
+        tcpPCB[pcbId].retranCnt = 0;
+    }
+
+    return bytes;
+}
+
+/*------------------------------------------------
+ * rto_update()
+ *
+ *  update the smoothed round-trip time and its variation with an RTT
+ *  measurement, and calculate the retransmit timeout (RFC 6298 section 2).
+ *  SRTT is kept scaled by 8 and RTTVAR by 4 so that the 1/8 and 1/4 gains are
+ *  shifts that do not lose the precision of a few milliseconds LAN RTT.
+ *
+ * param:  PCB ID, RTT measurement in mSec
+ * return: none
+ *
+ */
+static void rto_update(pcbid_t pcbId, uint32_t rtt)
+{
+    int32_t     delta;
+    uint32_t    rto;
+
+    if ( rtt == 0 )                                                                     // a '0' SRTT means there was no measurement
+        rtt = 1;
+
+    if ( tcpPCB[pcbId].SRTT == 0 )                                                      // first measurement
+    {
+        tcpPCB[pcbId].SRTT = rtt << 3;                                                  // SRTT <- R
+        tcpPCB[pcbId].RTTVAR = rtt << 1;                                                // RTTVAR <- R/2
+    }
+    else
+    {
+        delta = (int32_t) rtt - (int32_t) (tcpPCB[pcbId].SRTT >> 3);
+        tcpPCB[pcbId].SRTT += delta;                                                    // SRTT <- 7/8 SRTT + 1/8 R
+        if ( delta < 0 )
+            delta = -delta;
+        tcpPCB[pcbId].RTTVAR += delta - (tcpPCB[pcbId].RTTVAR >> 2);                    // RTTVAR <- 3/4 RTTVAR + 1/4 |SRTT - R|
+    }
+
+    rto = tcpPCB[pcbId].RTTVAR;                                                         // RTO <- SRTT + max(G, 4 RTTVAR)
+    if ( rto < TCP_TIMER_TICK )
+        rto = TCP_TIMER_TICK;
+    rto += tcpPCB[pcbId].SRTT >> 3;
+
+    if ( rto < TCP_MIN_RTO )
+        rto = TCP_MIN_RTO;
+    else if ( rto > TCP_MAX_RTO )
+        rto = TCP_MAX_RTO;
+
+    tcpPCB[pcbId].RT0 = rto;
+}
+
+/*------------------------------------------------
+ * fast_retransmit()
+ *
+ *  retransmit the oldest queued segment without waiting for the retransmit
+ *  timer, when the third duplicate ACK arrived (RFC 5681 section 3.2).
+ *  with congestion control the connection also enters NewReno fast recovery
+ *  (RFC 6582 section 3.2), unless the duplicate ACKs are for data that
+ *  was outstanding at the last timeout or fast retransmit.
+ *
+ * param:  PCB ID
+ * return: none
+ *
+ */
+static void fast_retransmit(pcbid_t pcbId)
+{
+    struct tcp_rtq_t   *entry;
+
+#if TCP_CONGESTION_CTRL
+    if ( tcpPCB[pcbId].SEG_ACK <= tcpPCB[pcbId].recover )
+    {
+        tcpPCB[pcbId].dupAcks = 0;                                                      // don't enter fast recovery
+        return;
+    }
+
+    ssthresh_update(pcbId);
+    tcpPCB[pcbId].recover = tcpPCB[pcbId].SND_NXT;
+    tcpPCB[pcbId].cwnd = tcpPCB[pcbId].ssthresh + DUPACK_THRESH * SMSS;                // the segments that left the network inflate the window
+#endif
+
+    entry = &(tcpPCB[pcbId].rtq[tcpPCB[pcbId].rtqHead]);
+    ip4_output(tcpPCB[pcbId].remoteIP, IP4_TCP, entry->pbuf);
+    entry->sendTime = 0L;                                                               // no RTT measurement from a retransmitted segment
+}
+
+#if TCP_CONGESTION_CTRL
+/*------------------------------------------------
+ * cwnd_update()
+ *
+ *  open the congestion window on an ACK of new data (RFC 5681 section 3.1).
+ *  the window grows by up to one segment per ACK in slow start, and by about
+ *  one segment per round-trip in congestion avoidance. there is no point in
+ *  growing it beyond what the retransmit queue can hold in flight.
+ *
+ * param:  PCB ID, byte count that the ACK acknowledged
+ * return: none
+ *
+ */
+static void cwnd_update(pcbid_t pcbId, uint32_t acked)
+{
+    uint32_t    increment;
+
+    if ( tcpPCB[pcbId].cwnd < tcpPCB[pcbId].ssthresh )                                 // slow start
+    {
+        increment = (acked < SMSS) ? acked : SMSS;
+    }
+    else                                                                                // congestion avoidance
+    {
+        increment = ((uint32_t) SMSS * SMSS) / tcpPCB[pcbId].cwnd;
+        if ( increment == 0 )
+            increment = 1;
+    }
+
+    tcpPCB[pcbId].cwnd += increment;
+    if ( tcpPCB[pcbId].cwnd > MAX_CWND )
+        tcpPCB[pcbId].cwnd = MAX_CWND;
+}
+
+/*------------------------------------------------
+ * ssthresh_update()
+ *
+ *  set the slow start threshold to half of the data in flight
+ *  when a loss is detected (RFC 5681 equation 4).
+ *
+ * param:  PCB ID
+ * return: none
+ *
+ */
+static void ssthresh_update(pcbid_t pcbId)
+{
+    uint32_t    flight;
+
+    flight = tcpPCB[pcbId].SND_NXT - tcpPCB[pcbId].SND_UNA;
+    if ( (flight / 2) > (2 * SMSS) )
+        tcpPCB[pcbId].ssthresh = flight / 2;
+    else
+        tcpPCB[pcbId].ssthresh = 2 * SMSS;
+}
+
+/*------------------------------------------------
+ * recovery_ack()
+ *
+ *  handle an ACK of new data in fast recovery (RFC 6582 section 3.2).
+ *  a full ACK of all the data that was outstanding when fast recovery started
+ *  ends it and deflates the window. a partial ACK means that the next segment
+ *  was lost too, so it is retransmitted right away and the window
+ *  is deflated by the amount of new data acknowledged.
+ *  the ACKed segments were already removed from the retransmit queue.
+ *
+ * param:  PCB ID, byte count that the ACK acknowledged
+ * return: none
+ *
+ */
+static void recovery_ack(pcbid_t pcbId, uint32_t acked)
+{
+    struct tcp_rtq_t   *entry;
+    uint32_t            flight;
+
+    if ( tcpPCB[pcbId].SEG_ACK >= tcpPCB[pcbId].recover )                               // full acknowledgment
+    {
+        flight = tcpPCB[pcbId].SND_NXT - tcpPCB[pcbId].SEG_ACK;
+        if ( (flight + SMSS) < tcpPCB[pcbId].ssthresh )
+            tcpPCB[pcbId].cwnd = flight + SMSS;
+        else
+            tcpPCB[pcbId].cwnd = tcpPCB[pcbId].ssthresh;
+        tcpPCB[pcbId].dupAcks = 0;                                                      // exit fast recovery
+        return;
+    }
+
+    if ( tcpPCB[pcbId].rtqCount > 0 )                                                   // partial acknowledgment
+    {
+        entry = &(tcpPCB[pcbId].rtq[tcpPCB[pcbId].rtqHead]);
+#if TCP_SACK
+        if ( !tcpPCB[pcbId].sackOk || entry->sendTime != 0 )                            // with SACK the hole may have been retransmitted already
+#endif
+        {
+            ip4_output(tcpPCB[pcbId].remoteIP, IP4_TCP, entry->pbuf);
+            entry->sendTime = 0L;
+        }
+    }
+
+    if ( tcpPCB[pcbId].cwnd > acked )
+        tcpPCB[pcbId].cwnd -= acked;
+    else
+        tcpPCB[pcbId].cwnd = 0;
+    if ( acked >= SMSS )
+        tcpPCB[pcbId].cwnd += SMSS;
+    if ( tcpPCB[pcbId].cwnd < SMSS )
+        tcpPCB[pcbId].cwnd = SMSS;
+}
+
+/*------------------------------------------------
+ * rtq_resend()
+ *
+ *  retransmit queued segments that were sent before a retransmit timeout
+ *  and were not yet retransmitted, as long as the congestion window allows.
+ *  a partial ACK of the data outstanding at the timeout means the next segment
+ *  was lost too (RFC 6582), so go-back-N is paced by the ACKs instead of
+ *  resending the whole queue at once.
+ *
+ * param:  PCB ID
+ * return: none
+ *
+ */
+static void rtq_resend(pcbid_t pcbId)
+{
+    struct tcp_rtq_t   *entry;
+    uint32_t            flight = 0;
+    int                 i, q;
+
+    q = tcpPCB[pcbId].rtqHead;
+    for ( i = 0; i < tcpPCB[pcbId].rtqCount; i++ )
+    {
+        entry = &(tcpPCB[pcbId].rtq[q]);
+        if ( entry->seq >= tcpPCB[pcbId].recover )                                      // segments sent after the timeout are not lost
+            break;
+
+#if TCP_SACK
+        if ( !entry->sacked )                                                           // the receiver has the SACKed ones
+#endif
+        {
+            if ( entry->sendTime != 0 )                                                 // not retransmitted yet
+            {
+                if ( flight > 0 && (flight + entry->len) > tcpPCB[pcbId].cwnd )
+                    break;
+                ip4_output(tcpPCB[pcbId].remoteIP, IP4_TCP, entry->pbuf);
+                entry->sendTime = 0L;                                                   // no RTT measurement from a retransmitted segment
+            }
+            flight += entry->len;
+        }
+
+        q++;
+        if ( q == TCP_MAX_INFLIGHT )
+            q = 0;
+    }
+}
+#endif
+
+#if TCP_OOQ_SPANS
+/*------------------------------------------------
+ * ooq_add()
+ *
+ *  copy the text of a segment that arrived out of order into the free part
+ *  of the receive buffer, where it will be when the missing data before it
+ *  arrives, and add its range to the sorted out-of-order list.
+ *  overlapping and adjacent ranges are merged. when the list is full,
+ *  the range farthest from RCV.NXT is dropped to make room.
+ *
+ * param:  PCB ID, pointer to segment text
+ * return: none
+ *
+ */
+static void ooq_add(pcbid_t pcbId, uint8_t *text)
+{
+    struct tcp_span_t  *ooq;
+    uint32_t            left, right;
+    tcp_win_t           offset, bytes, wrp;
+    int                 i, j, k;
+
+    if ( SEQ_LEQ(tcpPCB[pcbId].SEG_SEQ, tcpPCB[pcbId].RCV_NXT) )                        // only text beyond RCV.NXT
+        return;
+
+    offset = (tcp_win_t) (tcpPCB[pcbId].SEG_SEQ - tcpPCB[pcbId].RCV_NXT);
+    if ( offset >= tcpPCB[pcbId].RCV_WND )                                              // only text in the window, which is
+        return;                                                                         // the free part of the receive buffer
+
+    bytes = tcpPCB[pcbId].SEG_LEN;
+    if ( bytes > (tcpPCB[pcbId].RCV_WND - offset) )
+        bytes = tcpPCB[pcbId].RCV_WND - offset;
+
+    wrp = (tcpPCB[pcbId].recvWRp + offset) & CIRC_BUFFER_MASK;
+    if ( buf_room(tcpPCB[pcbId].recv, wrp, bytes, TCP_BUF_RESERVE) < bytes )            // only text that fits in the buffer chunks, and leaves
+        return;                                                                         // the reserve to text in order
+    buf_write(tcpPCB[pcbId].recv, wrp, text, bytes);
+
+    ooq = tcpPCB[pcbId].ooq;
+    left = tcpPCB[pcbId].SEG_SEQ;
+    right = left + bytes;
+#if TCP_SACK
+    tcpPCB[pcbId].ooqRecent = left;
+#endif
+
+    for ( i = 0; i < tcpPCB[pcbId].ooqCount && SEQ_LT(ooq[i].right, left); i++ );     // first range that is not entirely below the new one
+
+    for ( j = i; j < tcpPCB[pcbId].ooqCount && SEQ_LEQ(ooq[j].left, right); j++ )       // merge with ranges that overlap or touch the new one
+    {
+        if ( SEQ_LT(ooq[j].left, left) )
+            left = ooq[j].left;
+        if ( SEQ_GT(ooq[j].right, right) )
+            right = ooq[j].right;
+    }
+
+    if ( j == i )                                                                       // nothing merged, insert a new range at 'i'
+    {
+        if ( tcpPCB[pcbId].ooqCount == TCP_OOQ_SPANS )
+        {
+            if ( i == TCP_OOQ_SPANS )                                                   // the new range is the farthest
+                return;
+            tcpPCB[pcbId].ooqCount--;                                                   // drop the farthest range
+        }
+        for ( k = tcpPCB[pcbId].ooqCount; k > i; k-- )
+            ooq[k] = ooq[k - 1];
+        tcpPCB[pcbId].ooqCount++;
+    }
+    else                                                                                // ranges 'i' to 'j-1' merged into 'i'
+    {
+        for ( k = i + 1; j < tcpPCB[pcbId].ooqCount; k++, j++ )
+            ooq[k] = ooq[j];
+        tcpPCB[pcbId].ooqCount = k;
+    }
+
+    ooq[i].left = left;
+    ooq[i].right = right;
+}
+
+/*------------------------------------------------
+ * ooq_merge()
+ *
+ *  after in-order text was added to the receive buffer, append the out-of-order
+ *  ranges that are now in order, which are already in place in the buffer,
+ *  and advance RCV.NXT over them.
+ *
+ * param:  PCB ID
+ * return: none
+ *
+ */
+static void ooq_merge(pcbid_t pcbId)
+{
+    struct tcp_span_t  *ooq;
+    tcp_win_t           bytes;
+    int                 k;
+
+    ooq = tcpPCB[pcbId].ooq;
+
+    while ( tcpPCB[pcbId].ooqCount > 0 &&
+            SEQ_LEQ(ooq[0].left, tcpPCB[pcbId].RCV_NXT) )
+    {
+        if ( SEQ_GT(ooq[0].right, tcpPCB[pcbId].RCV_NXT) )
+        {
+            bytes = (tcp_win_t) (ooq[0].right - tcpPCB[pcbId].RCV_NXT);
+            tcpPCB[pcbId].recvCnt += bytes;
+            tcpPCB[pcbId].recvWRp += bytes;
+            tcpPCB[pcbId].recvWRp &= CIRC_BUFFER_MASK;
+            tcpPCB[pcbId].RCV_NXT += (uint32_t) bytes;
+            tcpPCB[pcbId].RCV_WND -= bytes;
+        }
+
+        tcpPCB[pcbId].ooqCount--;
+        for ( k = 0; k < tcpPCB[pcbId].ooqCount; k++ )
+            ooq[k] = ooq[k + 1];
+    }
+}
+#endif
+
+#if TCP_SACK
+/*------------------------------------------------
+ * sack_mark()
+ *
+ *  mark the queued segments that SACK blocks of the last received
+ *  segment cover entirely. they are not retransmitted but stay queued
+ *  until they are acknowledged, the receiver is allowed to discard them.
+ *
+ * param:  PCB ID
+ * return: count of segments that were not marked before
+ *
+ */
+static int sack_mark(pcbid_t pcbId)
+{
+    struct tcp_rtq_t   *entry;
+    struct tcp_span_t  *block;
+    int                 i, j, q, marked = 0;
+
+    for ( i = 0; i < tcpPCB[pcbId].RCV_opt.sackCount; i++ )
+    {
+        block = &(tcpPCB[pcbId].RCV_opt.sack[i]);
+        q = tcpPCB[pcbId].rtqHead;
+        for ( j = 0; j < tcpPCB[pcbId].rtqCount; j++ )
+        {
+            entry = &(tcpPCB[pcbId].rtq[q]);
+            if ( !entry->sacked &&
+                 SEQ_GEQ(entry->seq, block->left) &&
+                 SEQ_LEQ(entry->seq + entry->len, block->right) )
+            {
+                entry->sacked = 1;
+                marked++;
+            }
+            q++;
+            if ( q == TCP_MAX_INFLIGHT )
+                q = 0;
+        }
+    }
+
+    return marked;
+}
+
+/*------------------------------------------------
+ * sack_resend()
+ *
+ *  retransmit the oldest queued segment that the receiver did not
+ *  SACK although it SACKed a later one, and that was not retransmitted yet.
+ *  one segment is sent for every duplicate ACK, as ACKs arrive
+ *  for segments that left the network.
+ *
+ * param:  PCB ID
+ * return: none
+ *
+ */
+static void sack_resend(pcbid_t pcbId)
+{
+    struct tcp_rtq_t   *entry;
+    uint32_t            highSack;
+    int                 j, q;
+
+    highSack = tcpPCB[pcbId].SND_UNA;
+
+    q = tcpPCB[pcbId].rtqHead;
+    for ( j = 0; j < tcpPCB[pcbId].rtqCount; j++ )                                      // find the end of the highest SACKed segment
+    {
+        if ( tcpPCB[pcbId].rtq[q].sacked )
+            highSack = tcpPCB[pcbId].rtq[q].seq + tcpPCB[pcbId].rtq[q].len;
+        q++;
+        if ( q == TCP_MAX_INFLIGHT )
+            q = 0;
+    }
+
+    q = tcpPCB[pcbId].rtqHead;
+    for ( j = 0; j < tcpPCB[pcbId].rtqCount; j++ )
+    {
+        entry = &(tcpPCB[pcbId].rtq[q]);
+        if ( SEQ_GT(entry->seq + entry->len, highSack) )                                // only holes below SACKed data
+            break;
+
+        if ( !entry->sacked && entry->sendTime != 0 )
+        {
+            ip4_output(tcpPCB[pcbId].remoteIP, IP4_TCP, entry->pbuf);
+            entry->sendTime = 0L;                                                       // no RTT measurement from a retransmitted segment
+            break;
+        }
+
+        q++;
+        if ( q == TCP_MAX_INFLIGHT )
+            q = 0;
+    }
+}
+
+/*------------------------------------------------
+ * sack_reset()
+ *
+ *  forget SACK information of the queued segments
+ *
+ * param:  PCB ID
+ * return: none
+ *
+ */
+static void sack_reset(pcbid_t pcbId)
+{
+    int         i;
+
+    for ( i = 0; i < TCP_MAX_INFLIGHT; i++ )
+        tcpPCB[pcbId].rtq[i].sacked = 0;
+}
+
+#if TCP_OOQ_SPANS
+/*------------------------------------------------
+ * sack_blocks()
+ *
+ *  write SACK blocks of the out-of-order data held in the receive buffer
+ *  in network order. the first block holds the most recently received
+ *  segment, and the rest follow in sequence order (RFC 2018 section 4).
+ *
+ * param:  PCB ID, pointer to SACK blocks in the segment options, block count to write
+ * return: none
+ *
+ */
+static void sack_blocks(pcbid_t pcbId, struct tcp_span_t *blocks, uint8_t count)
+{
+    struct tcp_span_t  *ooq;
+    int                 i, recent = 0;
+    uint8_t             n;
+
+    ooq = tcpPCB[pcbId].ooq;
+
+    for ( i = 0; i < tcpPCB[pcbId].ooqCount; i++ )
+    {
+        if ( SEQ_LEQ(ooq[i].left, tcpPCB[pcbId].ooqRecent) &&
+             SEQ_LT(tcpPCB[pcbId].ooqRecent, ooq[i].right) )
+            recent = i;
+    }
+
+    blocks[0].left = stack_htonl(ooq[recent].left);
+    blocks[0].right = stack_htonl(ooq[recent].right);
+
+    for ( i = 0, n = 1; n < count; i++ )
+    {
+        if ( i == recent )
+            continue;
+        blocks[n].left = stack_htonl(ooq[i].left);
+        blocks[n].right = stack_htonl(ooq[i].right);
+        n++;
+    }
+}
+#endif
+#endif
+
+/*------------------------------------------------
+ * buf_room()
+ *
+ *  the byte count that can be written into a circular send or receive buffer,
+ *  in the chunks the buffer holds and the chunks that are free in the pool.
+ *  send buffers and out-of-order text leave TCP_BUF_RESERVE free chunks to
+ *  receiving text in order, so connections can always make progress.
+ *
+ * param:  buffer chunk slots, buffer index to write at, byte count to write,
+ *         free chunks that must be left in the pool
+ * return: byte count that can be written, up to the requested count
+ *
+ */
+static tcp_win_t buf_room(uint8_t **chunks, tcp_win_t index, tcp_win_t count, int reserve)
+{
+    tcp_win_t   room = 0;
+    int         avail = freeChunks - reserve;
+
+    while ( room < count )
+    {
+        if ( chunks[index / TCP_BUF_CHUNK] == NULL )                                    // a chunk will have to be taken from the pool
+        {
+            if ( avail <= 0 )
+                break;
+            avail--;
+        }
+        room += TCP_BUF_CHUNK - (index & CHUNK_MASK);
+        index = (index | CHUNK_MASK) + 1;                                               // start of next chunk
+        index &= CIRC_BUFFER_MASK;
+    }
+
+    return (room < count) ? room : count;
+}
+
+/*------------------------------------------------
+ * buf_write()
+ *
+ *  write bytes into a circular send or receive buffer, and take chunks from the pool
+ *  for the parts of the buffer that do not have one.
+ *  the byte count must be checked with buf_room() first.
+ *
+ * param:  buffer chunk slots, buffer index to write at, pointer to bytes, byte count
+ * return: none
+ *
+ */
+static void buf_write(uint8_t **chunks, tcp_win_t index, uint8_t *data, tcp_win_t count)
+{
+    tcp_win_t   run;
+
+    while ( count > 0 )
+    {
+        if ( chunks[index / TCP_BUF_CHUNK] == NULL )
+        {
+            assert(freeChunks > 0);
+            freeChunks--;
+            chunks[index / TCP_BUF_CHUNK] = freeChunk[freeChunks];
+        }
+
+        run = TCP_BUF_CHUNK - (index & CHUNK_MASK);                                     // copy up to the end of the chunk
+        if ( run > count )
+            run = count;
+        memcpy(&(chunks[index / TCP_BUF_CHUNK][index & CHUNK_MASK]), data, run);
+
+        data += run;
+        count -= run;
+        index += run;
+        index &= CIRC_BUFFER_MASK;                                                      // quick way to make pointer circular
+    }
+}
+
+/*------------------------------------------------
+ * buf_read()
+ *
+ *  read bytes from a circular send or receive buffer.
+ *  if 'acc' is not NULL the bytes are summed while they are copied, and their
+ *  sum is added to 'acc'. a run of bytes that starts at an odd offset from 'data'
+ *  has its sum's bytes swapped.
+ *
+ * param:  buffer chunk slots, buffer index to read from, pointer to destination, byte count,
+ *         pointer to 32bit accumulated sum or NULL
+ * return: none
+ *
+ */
+static void buf_read(uint8_t **chunks, tcp_win_t index, uint8_t *data, tcp_win_t count, uint32_t *acc)
+{
+    tcp_win_t   run, offset = 0;
+    uint16_t    sum;
+
+    while ( count > 0 )
+    {
+        run = TCP_BUF_CHUNK - (index & CHUNK_MASK);                                     // copy up to the end of the chunk
+        if ( run > count )
+            run = count;
+
+        if ( acc )
+        {
+            sum = stack_ntoh(stack_copy_checksum(data, &(chunks[index / TCP_BUF_CHUNK][index & CHUNK_MASK]), (int) run, 0UL));
+            if ( offset & 1 )
+                sum = (sum << 8) | (sum >> 8);
+            *acc += sum;
+        }
+        else
+        {
+            memcpy(data, &(chunks[index / TCP_BUF_CHUNK][index & CHUNK_MASK]), run);
+        }
+
+        offset += run;
+        data += run;
+        count -= run;
+        index += run;
+        index &= CIRC_BUFFER_MASK;                                                      // quick way to make pointer circular
+    }
+}
+
+/*------------------------------------------------
+ * buf_trim()
+ *
+ *  return the chunks of a connection's buffers that hold no data to the pool.
+ *  the send buffer holds the data from its read index that was not acknowledged,
+ *  the receive buffer holds the data that was not read and the out-of-order text
+ *  that is held beyond it.
+ *
+ * param:  PCB ID
+ * return: none
+ *
+ */
+static void buf_trim(pcbid_t pcbId)
+{
+    uint8_t   **chunks;
+    tcp_win_t   start, held;
+    int         b, i;
+
+    for ( b = 0; b < 2; b++ )
+    {
+        if ( b == 0 )
+        {
+            chunks = tcpPCB[pcbId].send;
+            start = tcpPCB[pcbId].sendRDp;
+            held = (tcp_win_t) tcpPCB[pcbId].sendCnt;
+        }
+        else
+        {
+            chunks = tcpPCB[pcbId].recv;
+            start = tcpPCB[pcbId].recvRDp;
+            held = (tcp_win_t) tcpPCB[pcbId].recvCnt;
+#if TCP_OOQ_SPANS
+            if ( tcpPCB[pcbId].ooqCount > 0 )
+                held += (tcp_win_t) (tcpPCB[pcbId].ooq[tcpPCB[pcbId].ooqCount - 1].right - tcpPCB[pcbId].RCV_NXT);
+#endif
         }
 
-        pseudoHdrSum = pseudo_header_sum(tcpPCB[pcbId].localIP, tcpPCB[pcbId].remoteIP, TCP_HDR_LEN + OPT_BYTES + sendCount); // calculate pseudo-header checksum
-        checksumTemp = stack_checksumEx(tcp, TCP_HDR_LEN + OPT_BYTES  + sendCount, pseudoHdrSum);
-        tcp->checksum = ~checksumTemp;
-
-        p->len = FRAME_HDR_LEN + IP_HDR_LEN + TCP_HDR_LEN + OPT_BYTES + sendCount;      // set packet length
-        if ( flags & TCP_FLAG_FIN )                                                     // optional count of FIN signal
-            sendCount++;
+        for ( i = 0; i < TCP_BUF_SLOTS; i++ )
+        {
+            if ( chunks[i] == NULL ||
+                 (held > 0 && start / TCP_BUF_CHUNK == i) ||                            // the chunk with the first byte held
+                 ((((tcp_win_t) i * TCP_BUF_CHUNK) - start) & CIRC_BUFFER_MASK) < held ) // or a chunk that starts in the held bytes
+                continue;
+
+            freeChunk[freeChunks] = chunks[i];
+            freeChunks++;
+            chunks[i] = NULL;
+        }
     }
+}
 
-    /* after sending the segment check if it needs to be queued.
-     * only queue segments that have a control flag other than ACK,
-     * such as SYN or FIN, or segments that carry data.
-     * a segment with only an ACK and not data (length == 0) will not be queued.
-     * such a segment will be transmitted and the pbuf is freed.
-     */
-    result = ip4_output(tcpPCB[pcbId].remoteIP, IP4_TCP, p);                            // transmit the TCP segment
-
-    tcpPCB[pcbId].SND_NXT += sendCount;                                                 // adjust the send next count
+/*------------------------------------------------
+ * buf_free()
+ *
+ *  return all the chunks of a connection's buffers to the pool
+ *
+ * param:  PCB ID
+ * return: none
+ *
+ */
+static void buf_free(pcbid_t pcbId)
+{
+    int     i;
 
-    if ( (flags & (TCP_FLAG_FIN + TCP_FLAG_SYN)) ||                                     // only queue segments that need to be acknowledged
-          sendCount > 0 )                                                               // ones that have control flags other than ACK or contain data
-    {
-        tcpPCB[pcbId].sendTime = tcpPCB[pcbId].SND_opt.time;                            // time stamp for retransmit calculations and Ack segment matching
-        tcpPCB[pcbId].resendTime = tcpPCB[pcbId].SND_opt.time;
-        tcpPCB[pcbId].retranCnt = 0;                                                    // retransmit count
-        tcpPCB[pcbId].pbufQ = p;                                                        // queue the segment
-    }
-    else
+    for ( i = 0; i < TCP_BUF_SLOTS; i++ )
     {
-        pbuf_free(p);                                                                   // free the pbuf if no queuing is needed
+        if ( tcpPCB[pcbId].send[i] != NULL )
+        {
+            freeChunk[freeChunks] = tcpPCB[pcbId].send[i];
+            freeChunks++;
+            tcpPCB[pcbId].send[i] = NULL;
+        }
+        if ( tcpPCB[pcbId].recv[i] != NULL )
+        {
+            freeChunk[freeChunks] = tcpPCB[pcbId].recv[i];
+            freeChunks++;
+            tcpPCB[pcbId].recv[i] = NULL;
+        }
     }
-
-#if DEBUG_ON
-    printf("<- %s() %d\n", __func__, result);
-#endif
-
-    return result;
 }
 
 /*------------------------------------------------
  * send_rst_segment()
  *
  *  this function sends a TCP Reset (RST) segment and flags.
+ *  it also sends the ACKs of connections in TIME-WAIT, which have no PCB.
  *
  * param:  (...) segment flags (TCP_FLAG_ACK)
  * return: ERR_OK if no errors or ip4_err_t with error code
@@ -1603,7 +3331,7 @@ static ip4_err_t send_rst_segment(ip4_addr_t srcIP, uint16_t srcPort,
     /* calculate checksum and send the segment
      * to the destination target IP address
      */
-    pseudoHdrSum = pseudo_header_sum(srcIP, tgtIP, TCP_HDR_LEN);
+    pseudoHdrSum = ip4_pseudo_sum(srcIP, tgtIP, IP4_TCP, TCP_HDR_LEN);
     checksumTemp = stack_checksumEx(tcp, TCP_HDR_LEN, pseudoHdrSum);
     tcp->checksum = ~checksumTemp;
 
@@ -1625,9 +3353,9 @@ static ip4_err_t send_rst_segment(ip4_addr_t srcIP, uint16_t srcPort,
  *   y      1 (8 bits): No operation (NOP, Padding) This may be used to align option fields on 32-bit boundaries for better performance.
  *   y      2,4,SS (32 bits): Maximum segment size (see maximum segment size) [SYN]
  *   y      3,3,S (24 bits): Window scale (see window scaling for details) [SYN][6]
- *   n      4,2 (16 bits): Selective Acknowledgement permitted. [SYN] (See selective acknowledgments for details)[7]
- *   n      5,N,BBBB,EEEE,... (variable bits, N is either 10, 18, 26, or 34)- Selective ACKnowledgement (SACK)[8] These first two bytes are followed by a list of 1–4 blocks being selectively acknowledged, specified as 32-bit begin/end pointers.
- *   n      8,10,TTTT,EEEE (80 bits)- Timestamp and echo of previous timestamp (see TCP timestamps for details)[9]
+ *   y      4,2 (16 bits): Selective Acknowledgement permitted. [SYN] (See selective acknowledgments for details)[7]
+ *   y      5,N,BBBB,EEEE,... (variable bits, N is either 10, 18, 26, or 34)- Selective ACKnowledgement (SACK)[8] These first two bytes are followed by a list of 1–4 blocks being selectively acknowledged, specified as 32-bit begin/end pointers.
+ *   y      8,10,TTTT,EEEE (80 bits)- Timestamp and echo of previous timestamp (see TCP timestamps for details)[9]
  *
  * param:  options byte count, pointer to options' byte list, pointer to options PCB member
  * return: none
@@ -1636,6 +3364,9 @@ static ip4_err_t send_rst_segment(ip4_addr_t srcIP, uint16_t srcPort,
 static void get_tcp_opt(uint8_t bytes, uint8_t *optList, struct tcp_opt_t *options)
 {
     uint8_t     byteCount;
+#if TCP_SACK
+    uint8_t     i;
+#endif
 
 #if DEBUG_ON
     printf("-> %s()\n", __func__);
@@ -1675,6 +3406,41 @@ static void get_tcp_opt(uint8_t bytes, uint8_t *optList, struct tcp_opt_t *optio
                 bytes -= byteCount;
                 break;
 
+#if TCP_SACK
+            case 4:
+                byteCount = *(optList++);               // SACK permitted
+                if ( byteCount < 2 || byteCount > bytes )
+                {
+                    bytes = 0;                          // bad option length, stop parsing
+                    break;
+                }
+                options->sackOk = 1;
+                optList += (byteCount-2);
+                bytes -= byteCount;
+                break;
+
+            case 5:
+                byteCount = *(optList++);               // get SACK blocks, keep the first ones if there are too many
+                if ( byteCount < 2 || byteCount > bytes || ((byteCount - 2) % 8) != 0 )
+                {
+                    bytes = 0;                          // bad option length, stop parsing
+                    break;
+                }
+                for ( i = 2; (i + 8) <= byteCount; i += 8 )
+                {
+                    if ( options->sackCount < TCP_SACK_BLOCKS )
+                    {
+                        options->sack[options->sackCount].left = stack_ntohl(*((uint32_t*)optList));
+                        options->sack[options->sackCount].right = stack_ntohl(*((uint32_t*)(optList + 4)));
+                        options->sackCount++;
+                    }
+                    optList += 8;
+                }
+                optList += (byteCount-i);
+                bytes -= byteCount;
+                break;
+#endif
+
             case 8:
                 byteCount = *(optList++);               // get time stamp info
                 options->time = stack_ntohl(*((uint32_t*)optList));
@@ -1698,49 +3464,245 @@ static void get_tcp_opt(uint8_t bytes, uint8_t *optList, struct tcp_opt_t *optio
     }
 }
 
+#if TCP_WIN_SCALE
+/*------------------------------------------------
+ * set_win_scale()
+ *
+ *  set the window scale shift counts of a connection from the
+ *  window scale option in a received SYN (RFC 7323).
+ *  windows are scaled only if both SYN segments carried the option,
+ *  otherwise the windows are used as is and limited to 64KB.
+ *
+ * param:  PCB ID
+ * return: none
+ *
+ */
+static void set_win_scale(pcbid_t pcbId)
+{
+    if ( tcpPCB[pcbId].RCV_opt.winScale != TCP_WSCALE_NONE &&
+         tcpPCB[pcbId].SND_opt.winScale != TCP_WSCALE_NONE )
+    {
+        tcpPCB[pcbId].sndShift = tcpPCB[pcbId].RCV_opt.winScale;
+        if ( tcpPCB[pcbId].sndShift > TCP_WSCALE_MAX )                                  // RFC 7323, use 14 if a larger shift is received
+            tcpPCB[pcbId].sndShift = TCP_WSCALE_MAX;
+        tcpPCB[pcbId].rcvShift = tcpPCB[pcbId].SND_opt.winScale;
+    }
+    else
+    {
+        tcpPCB[pcbId].sndShift = 0;
+        tcpPCB[pcbId].rcvShift = 0;
+    }
+}
+#endif
+
 /*------------------------------------------------
- * pseudo_header_sum()
+ * payload_sum()
  *
- *  this function calculates a TCP pseudo header sum.
+ *  this function calculates the sum of a segment's payload.
+ *  ranges of the payload that were queued with tcp_send_sum() add their
+ *  precomputed checksum, and only the bytes outside of these ranges are summed.
+ *  a range that starts at an odd offset in the payload has its sum's bytes swapped.
  *  the output is only useful as input to stack_checksumEx()
  *
- * param:  PCB ID of connection, length of TCP segment
- * return: 32bit accumulated sum of pseudo-header bytes
+ * param:  PCB ID of connection, pointer to payload, sequence number of first payload byte,
+ *         payload offset to start summing from, payload length
+ * return: 32bit accumulated sum of payload
  *
  */
-static uint32_t pseudo_header_sum(ip4_addr_t source, ip4_addr_t dest, uint16_t tcpLen)
+static uint32_t payload_sum(pcbid_t pcbId, uint8_t *text, uint32_t seq, uint16_t from, uint16_t len)
 {
-    struct pseudo_header_t  header;
-    const uint8_t          *octetptr;
-    uint32_t                acc;
-    uint16_t                src;
+    struct tcp_sum_hint_t  *hint;
+    uint32_t                acc = 0;
+    uint32_t                dist;
+    uint16_t                offset = from;
+    uint16_t                count, sum;
     int                     i;
 
-    header.srcIp = source;
-    header.destIp = dest;
-    header.zero = 0;
-    header.protocol = IP4_TCP;
-    header.tcpLen = stack_hton(tcpLen);
-
-    octetptr = (const uint8_t*)&header;
-    acc = 0;
-    for (i = 0; i < sizeof(struct pseudo_header_t); i += 2)
+    while ( offset < len )
     {
-        src = (*octetptr) << 8;
-        octetptr++;
-        src |= (*octetptr);
-        octetptr++;
-        acc += src;
+        count = len - offset;                                               // by default sum the rest of the payload
+        hint = NULL;
+
+        for ( i = 0; i < TCP_SUM_HINTS; i++ )
+        {
+            if ( tcpPCB[pcbId].sumHint[i].len == 0 )
+                continue;
+
+            dist = tcpPCB[pcbId].sumHint[i].seq - (seq + offset);           // distance to start of hint range
+            if ( dist == 0 &&
+                 tcpPCB[pcbId].sumHint[i].len <= count )                    // a hint range starts here and ends in the payload
+            {
+                hint = &(tcpPCB[pcbId].sumHint[i]);
+                break;
+            }
+            else if ( dist > 0 && dist < count )                            // only sum up to the start of a hint range
+            {
+                count = (uint16_t) dist;
+            }
+        }
+
+        if ( hint )
+        {
+            count = hint->len;
+            sum = stack_ntoh(hint->sum);
+        }
+        else
+        {
+            sum = stack_ntoh(stack_checksumEx(&text[offset], count, 0UL));
+        }
+
+        if ( offset & 1 )
+            sum = (sum << 8) | (sum >> 8);
+
+        acc += sum;
+        offset += count;
     }
 
     return acc;
 }
 
+/*------------------------------------------------
+ * has_sum_hint()
+ *
+ *  check if data to be sent overlaps a range that has a precomputed checksum
+ *
+ * param:  PCB ID of connection, sequence number of first byte, byte count
+ * return: non '0' if a range with a precomputed checksum overlaps the data
+ *
+ */
+static int has_sum_hint(pcbid_t pcbId, uint32_t seq, uint16_t len)
+{
+    int     i;
+
+    for ( i = 0; i < TCP_SUM_HINTS; i++ )
+    {
+        if ( tcpPCB[pcbId].sumHint[i].len == 0 )
+            continue;
+
+        if ( tcpPCB[pcbId].sumHint[i].seq < (seq + len) &&
+             (tcpPCB[pcbId].sumHint[i].seq + tcpPCB[pcbId].sumHint[i].len) > seq )
+            return 1;
+    }
+
+    return 0;
+}
+
+/*------------------------------------------------
+ * add_sum_hint()
+ *
+ *  remember the checksum of a range of data to be sent
+ *
+ * param:  PCB ID, sequence number of first byte in range, range byte count,
+ *         checksum of the range as returned by stack_checksum()
+ * return: none
+ *
+ */
+static void add_sum_hint(pcbid_t pcbId, uint32_t seq, uint16_t len, uint16_t sum)
+{
+    struct tcp_sum_hint_t  *hint;
+
+    hint = &(tcpPCB[pcbId].sumHint[tcpPCB[pcbId].sumHintWr]);                           // overwrite the oldest hint
+    hint->seq = seq;
+    hint->len = len;
+    hint->sum = sum;
+    tcpPCB[pcbId].sumHintWr++;
+    if ( tcpPCB[pcbId].sumHintWr == TCP_SUM_HINTS )
+        tcpPCB[pcbId].sumHintWr = 0;
+}
+
+/*------------------------------------------------
+ * produce_data()
+ *
+ *  call the PCB's producer until it wrote the requested byte count into
+ *  the segment, or until it has no more data to write.
+ *  checksums the producer returns are remembered as hints for payload_sum().
+ *  the producer is released after it wrote all its data, or when it fails to write
+ *  data it still owes, such as after a read error, because it would not be called again.
+ *
+ * param:  PCB ID, pointer to segment payload area, sequence number of first byte,
+ *         byte count to write
+ * return: byte count written
+ *
+ */
+static uint16_t produce_data(pcbid_t pcbId, uint8_t *text, uint32_t seq, uint16_t len)
+{
+    uint16_t    count = 0, sum;
+    int         written;
+
+    while ( count < len )
+    {
+        sum = 0;
+        written = tcpPCB[pcbId].producer(tcpPCB[pcbId].producerCtx, tcpPCB[pcbId].prodOffset,
+                                         &text[count], len - count, &sum);
+        if ( written <= 0 )                                                             // the producer failed
+        {
+            tcpPCB[pcbId].prodFailed = 1;
+            break;
+        }
+
+        if ( written > (len - count) )
+            written = len - count;
+
+        if ( sum != 0 )
+            add_sum_hint(pcbId, seq + count, (uint16_t) written, sum);
+
+        tcpPCB[pcbId].prodOffset += written;
+        count += written;
+    }
+
+    if ( tcpPCB[pcbId].prodOffset >= tcpPCB[pcbId].prodLen ||
+         tcpPCB[pcbId].prodFailed )
+    {
+        tcpPCB[pcbId].producer = NULL;
+        tcpPCB[pcbId].producerCtx = NULL;
+    }
+
+    return count;
+}
+
+#if TCP_HDR_TEMPLATE
+/*------------------------------------------------
+ * hdr_template()
+ *
+ *  return the interface of the connection's header template, and build the
+ *  template if the connection has none. the template holds the frame and IP headers
+ *  made by ip4_template(), and a TCP header with the ports and urgent pointer.
+ *  its sum with the pseudo-header is kept, so that a segment only adds the length
+ *  and the header fields that change per segment.
+ *
+ * param:  PCB ID
+ * return: network interface to send the segment through, NULL if no template
+ *
+ */
+static struct net_interface_t* hdr_template(pcbid_t pcbId)
+{
+    struct tcp_t       *tcp;
+
+    if ( tcpPCB[pcbId].tmplNetif == NULL )
+    {
+        tcpPCB[pcbId].tmplNetif = ip4_template(tcpPCB[pcbId].remoteIP, IP4_TCP, IP_HDR_LEN + TCP_HDR_LEN, tcpPCB[pcbId].tmpl);
+        if ( tcpPCB[pcbId].tmplNetif == NULL )                                          // no route, or HW address not resolved yet
+            return NULL;
+
+        tcp = (struct tcp_t*) &(tcpPCB[pcbId].tmpl[FRAME_HDR_LEN + IP_HDR_LEN]);
+        memset(tcp, 0, TCP_HDR_LEN);
+        tcp->srcPort = stack_hton(tcpPCB[pcbId].localPort);
+        tcp->destPort = stack_hton(tcpPCB[pcbId].remotePort);
+        tcp->urgentPtr = stack_hton(tcpPCB[pcbId].SND_UP);
+
+        tcpPCB[pcbId].tmplSum = ip4_pseudo_sum(tcpPCB[pcbId].localIP, tcpPCB[pcbId].remoteIP, IP4_TCP, 0) +
+                                stack_ntoh(stack_checksum(tcp, TCP_HDR_LEN));
+    }
+
+    return tcpPCB[pcbId].tmplNetif;
+}
+#endif
+
 /*------------------------------------------------
  * tcp_timeout_handler()
  *
- *  timeout handler is invoked every 250mSec and will scan
- *  PCB list and TODO other lists to handle timeout conditions
+ *  timeout handler is invoked every TCP_TIMER_TICK mSec and will scan
+ *  PCB list and the TIME-WAIT table to handle timeout conditions
  *
  * param:  long unsigned integer of time at which handler was invoked
  * return: none
@@ -1749,8 +3711,22 @@ static uint32_t pseudo_header_sum(ip4_addr_t source, ip4_addr_t dest, uint16_t t
 static void tcp_timeout_handler(uint32_t now)
 {
     pcbid_t     i;
+#if !TCP_CONGESTION_CTRL
+    int         j, q;
+#endif
     uint32_t    timeOut;
 
+#if TCP_TW_COUNT
+    for (i = 0; i < TCP_TW_COUNT; i++)                                      // scan TIME-WAIT table
+    {
+        if ( twTable[i].localPort != 0 &&
+             (now - twTable[i].timeInState) >= ((uint32_t)(2 * TCP_MSL_TIMEOUT)) ) // if 2xMSL timeout has expired
+        {
+            twTable[i].localPort = 0;                                       // close the connection
+        }
+    }
+#endif
+
     for (i = 0; i < TCP_PCB_COUNT; i++)                                     // scan PCB list
     {
         switch ( tcpPCB[i].state )
@@ -1772,9 +3748,63 @@ static void tcp_timeout_handler(uint32_t now)
                 break;
         }
 
-        if ( tcpPCB[i].pbufQ != NULL )                                      // if a segment is queued
+#if TCP_DELAYED_ACK
+        if ( tcpPCB[i].ackPending &&                                        // send a delayed ACK
+             (now - tcpPCB[i].ackTime) >= TCP_ACK_DELAY )
+        {
+            send_ack(i);
+        }
+#endif
+
+        /* data waits to be sent and nothing is in flight, so no ACK will
+         * bring another send_data() call
+         */
+        if ( (tcpPCB[i].state == ESTABLISHED || tcpPCB[i].state == CLOSE_WAIT) &&
+             tcpPCB[i].rtqCount == 0 &&
+             unsent_bytes(i) > 0 )
+        {
+            /* the send was held back when other connections took all TCP_RTQ_BUFS
+             * retransmit queue buffers, try it again
+             */
+            if ( tcpPCB[i].SND_WND > 0 )
+            {
+                tcpPCB[i].persistCnt = 0;
+                send_data(i);
+            }
+
+            /* persist timer (RFC 1122 4.2.2.17), the peer closed its window and the
+             * window update that opens it can be lost. probe the window with
+             * increasing intervals for as long as it is closed
+             */
+            else if ( tcpPCB[i].persistCnt == 0 )                           // start the persist timer
+            {
+                tcpPCB[i].persistCnt = 1;
+                tcpPCB[i].persistTime = now;
+            }
+            else
+            {
+                timeOut = tcpPCB[i].RT0 << (tcpPCB[i].persistCnt - 1);      // probe interval with exponential back-off
+                if ( timeOut > TCP_MAX_RTO )
+                    timeOut = TCP_MAX_RTO;
+                if ( (now - tcpPCB[i].persistTime) >= timeOut )
+                {
+                    send_probe(i);
+                    tcpPCB[i].persistTime = now;
+                    if ( timeOut < TCP_MAX_RTO )
+                        tcpPCB[i].persistCnt++;
+                }
+            }
+        }
+        else
+        {
+            tcpPCB[i].persistCnt = 0;                                       // no data waits or data is in flight
+        }
+
+        if ( tcpPCB[i].rtqCount > 0 )                                       // if a segment is queued
         {
-            timeOut = tcpPCB[i].RT0 << tcpPCB[i].retranCnt;                 // calculate retransmit timeout value
+            timeOut = tcpPCB[i].RT0 << tcpPCB[i].retranCnt;                 // calculate retransmit timeout value with exponential back-off
+            if ( timeOut > TCP_MAX_RTO )
+                timeOut = TCP_MAX_RTO;
             if ( tcpPCB[i].retranCnt > TCP_MAX_RETRAN )                     // check if the retransmit count was exceeded
             {
                 send_sig(i,TCP_EVENT_ABORTED);                              // signal the application that the connection is being aborted
@@ -1782,7 +3812,31 @@ static void tcp_timeout_handler(uint32_t now)
             }                                                               // otherwise
             else if ( (now - tcpPCB[i].resendTime) >= timeOut )
             {                                                               // if the RTT time was exceeded then
-                ip4_output(tcpPCB[i].remoteIP, IP4_TCP, tcpPCB[i].pbufQ);   // retransmit the TCP segment
+#if TCP_SACK
+                sack_reset(i);                                              // RFC 2018 section 8, the receiver may have discarded SACKed data
+#endif
+#if TCP_HDR_TEMPLATE
+                tcpPCB[i].tmplNetif = NULL;                                 // build the header template again, the route or HW address may have changed
+#endif
+#if TCP_CONGESTION_CTRL
+                if ( tcpPCB[i].retranCnt == 0 )                             // RFC 5681 section 3.1, halve the window for the data outstanding
+                    ssthresh_update(i);                                     // at the first timeout, not again when the same segment times out
+                tcpPCB[i].cwnd = SMSS;                                      // and restart from one segment in slow start
+                tcpPCB[i].recover = tcpPCB[i].SND_NXT;
+                ip4_output(tcpPCB[i].remoteIP, IP4_TCP, tcpPCB[i].rtq[tcpPCB[i].rtqHead].pbuf); // retransmit the oldest segment, rtq_resend() sends the
+                tcpPCB[i].rtq[tcpPCB[i].rtqHead].sendTime = 0L;             // others as ACKs arrive
+#else
+                q = tcpPCB[i].rtqHead;                                      // retransmit the queued segments starting from the oldest one,
+                for ( j = 0; j < tcpPCB[i].rtqCount; j++ )                  // segments that followed a lost one were dropped by the receiver
+                {
+                    ip4_output(tcpPCB[i].remoteIP, IP4_TCP, tcpPCB[i].rtq[q].pbuf);
+                    tcpPCB[i].rtq[q].sendTime = 0L;                         // no RTT measurement from a retransmitted segment
+                    q++;
+                    if ( q == TCP_MAX_INFLIGHT )
+                        q = 0;
+                }
+#endif
+                tcpPCB[i].dupAcks = 0;                                      // a timeout ends fast recovery
                 tcpPCB[i].resendTime = now;
                 tcpPCB[i].retranCnt++;                                      // increment retransmit count -> double the interval
             }
@@ -1801,14 +3855,148 @@ static void tcp_timeout_handler(uint32_t now)
  */
 static void free_tcp_pcb(pcbid_t pcbId)
 {
+    int     i;
+
     if ( pcbId >= TCP_PCB_COUNT )
         return;
 
-    if ( tcpPCB[pcbId].pbufQ != NULL )
-        pbuf_free(tcpPCB[pcbId].pbufQ);                                     // free the pbuf
+    while ( tcpPCB[pcbId].rtqCount > 0 )                                    // free queued pbufs
+    {
+        pbuf_free(tcpPCB[pcbId].rtq[tcpPCB[pcbId].rtqHead].pbuf);
+        rtqBufs--;
+        tcpPCB[pcbId].rtqHead++;
+        if ( tcpPCB[pcbId].rtqHead == TCP_MAX_INFLIGHT )
+            tcpPCB[pcbId].rtqHead = 0;
+        tcpPCB[pcbId].rtqCount--;
+    }
+
+    buf_free(pcbId);                                                        // return buffer chunks to the pool
+    pcb_hash_remove(pcbId);                                                 // remove from the lookup tables
+    for (i = 0; i < TCP_SERVER_COUNT; i++)
+    {
+        if ( listenPcb[i] == pcbId )
+            listenPcb[i] = NO_PCB;
+    }
+    if ( tcpPCB[pcbId].state != FREE )                                      // return to the free PCB stack
+    {
+        freePcb[freePcbs] = pcbId;
+        freePcbs++;
+    }
 
     memset(&(tcpPCB[pcbId]), 0, sizeof(struct tcp_pcb_t));                  // clear all resources associated with this PCB
-    tcpPCB[pcbId].send = &(sendBuff[pcbId][0]);                             // re-link to send and receive buffers
-    tcpPCB[pcbId].recv = &(recvBuff[pcbId][0]);
     set_state(pcbId,FREE);                                                  // close the connection
 }
+
+#if TCP_TW_COUNT
+/*------------------------------------------------
+ * time_wait()
+ *
+ *  move a connection to the TIME-WAIT table and free its PCB.
+ *  the table entry keeps the connection's IP/port and sequence numbers
+ *  to acknowledge a retransmitted remote FIN until 2xMSL expires.
+ *  if the table is full the oldest entry is replaced.
+ *
+ * param:  a valid TCP PCB ID
+ * return: none
+ *
+ */
+static void time_wait(pcbid_t pcbId)
+{
+    uint32_t    now;
+    int         i, tw = 0;
+
+    now = stack_time();
+
+    for (i = 0; i < TCP_TW_COUNT; i++)
+    {
+        if ( twTable[i].localPort == 0 )                                    // use a free entry
+        {
+            tw = i;
+            break;
+        }
+        if ( (now - twTable[i].timeInState) > (now - twTable[tw].timeInState) )
+            tw = i;                                                         // or the oldest one
+    }
+
+    twTable[tw].localIP = tcpPCB[pcbId].localIP;
+    twTable[tw].localPort = tcpPCB[pcbId].localPort;
+    twTable[tw].remoteIP = tcpPCB[pcbId].remoteIP;
+    twTable[tw].remotePort = tcpPCB[pcbId].remotePort;
+    twTable[tw].SND_NXT = tcpPCB[pcbId].SND_NXT;
+    twTable[tw].RCV_NXT = tcpPCB[pcbId].RCV_NXT;
+    twTable[tw].timeInState = now;
+
+    free_tcp_pcb(pcbId);                                                    // the PCB and its buffers are not used any more
+}
+
+/*------------------------------------------------
+ * find_tw()
+ *
+ *  find a connection in the TIME-WAIT table
+ *
+ * param:  IP/port pairs for local and remote
+ * return: TIME-WAIT table index, or '-1' if not found
+ *
+ */
+static int find_tw(ip4_addr_t localIP, uint16_t localPort, ip4_addr_t remoteIP, uint16_t remotePort)
+{
+    int     i;
+
+    for (i = 0; i < TCP_TW_COUNT; i++)
+    {
+        if ( twTable[i].localPort == localPort &&                          // match local and remote IP/port
+             twTable[i].remotePort == remotePort &&
+             twTable[i].localIP == localIP &&
+             twTable[i].remoteIP == remoteIP )
+            return i;
+    }
+
+    return -1;
+}
+
+/*------------------------------------------------
+ * tw_input()
+ *
+ *  process a segment of a connection in the TIME-WAIT table.
+ *  an acceptable RST closes the connection, and a SYN with a sequence number
+ *  beyond the old connection's reopens it (RFC 1122 4.2.2.13) so a listener can accept it.
+ *  any other segment is acknowledged, and a retransmitted
+ *  remote FIN restarts the 2xMSL timeout.
+ *
+ * param:  TIME-WAIT table index, pointer to the segment's TCP header
+ * return: '1' if the segment was processed, '0' if the connection was closed for a new SYN
+ *
+ */
+static int tw_input(int tw, struct tcp_t *tcp)
+{
+    uint16_t    flags;
+    uint32_t    seq;
+
+    flags = stack_ntoh(tcp->dataOffsAndFlags) & FLAGS_MASK;
+    seq = stack_ntohl(tcp->seq);
+
+    if ( flags & TCP_FLAG_RST )
+    {
+        if ( seq == twTable[tw].RCV_NXT )
+            twTable[tw].localPort = 0;
+        return 1;
+    }
+
+    if ( (flags & TCP_FLAG_SYN) &&
+         !(flags & TCP_FLAG_ACK) &&
+         seq > twTable[tw].RCV_NXT )
+    {
+        twTable[tw].localPort = 0;
+        return 0;
+    }
+
+    if ( flags & TCP_FLAG_FIN )
+        twTable[tw].timeInState = stack_time();                             // restart the 2 MSL timeout
+
+    send_rst_segment(twTable[tw].localIP, twTable[tw].localPort,            // send <SEQ=SND.NXT><ACK=RCV.NXT><CTL=ACK>
+                     twTable[tw].remoteIP, twTable[tw].remotePort,
+                     twTable[tw].SND_NXT, twTable[tw].RCV_NXT,
+                     0, TCP_FLAG_ACK);
+    return 1;
+}
+#endif
@@ -154,6 +154,8 @@ ip4_err_t udp_sendto(struct udp_pcb_t *pcb, uint8_t* const payload, uint16_t pay
     ip4_err_t       result = ERR_OK;
     struct udp_t   *udp;
     struct pbuf_t  *p;
+    uint32_t        acc;
+    uint16_t        sum;
 
     if ( payloadLen > MAX_DATAGRAM_LEN )                                            // limit on datagram size
         return ERR_MTU_EXD;
@@ -166,8 +168,15 @@ ip4_err_t udp_sendto(struct udp_pcb_t *pcb, uint8_t* const payload, uint16_t pay
         udp->srcPort = stack_ntoh(pcb->localPort);                                  // populate UDP header
         udp->destPort = stack_ntoh(destPort);
         udp->length = stack_ntoh(payloadLen + UDP_HDR_LEN);
-        udp->checksum = 0;                                                          // not using checksum
-        memcpy(&(udp->payloadStart), payload, payloadLen);                          // copy payload
+        udp->checksum = 0;                                                          // replace after calculating
+
+        /* copy the payload and sum it in one pass, then add the header and pseudo-header.
+         * a calculated checksum of '0' is sent as all ones, '0' means no checksum
+         */
+        sum = stack_copy_checksum(&(udp->payloadStart), payload, payloadLen, 0UL);
+        acc = ip4_pseudo_sum(pcb->localIP, destIP, IP4_UDP, payloadLen + UDP_HDR_LEN) + stack_ntoh(sum);
+        sum = ~(stack_checksumEx(udp, UDP_HDR_LEN, acc));
+        udp->checksum = (sum == 0) ? 0xffff : sum;
 
         p->len = FRAME_HDR_LEN + IP_HDR_LEN + UDP_HDR_LEN + payloadLen;             // set packet length
         result = ip4_output(destIP, IP4_UDP, p);                                    // transmit the UDP datagram
@@ -229,6 +238,10 @@ static void udp_input_handler(struct pbuf_t* const p)
     ipHeaderLen = (ip->verHeaderLength & 0x0f) * 4;                                     // calculate header length in bytes
     udp = (struct udp_t*)(((uint8_t*) ip) + ipHeaderLen);                               // pointer to the UDP header
 
+    if ( udp->checksum != 0 &&                                                          // drop the datagram if it has a checksum that does not match
+         ip4_payload_checksum(p) != 0xffff )
+        return;
+
     addr = ip->destIp;                                                                  // extract destination IP and port
     port = stack_hton(udp->destPort);
 
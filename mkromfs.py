@@ -0,0 +1,165 @@
+#!/usr/bin/env python
+
+#==========================================================================
+# mkromfs.py
+#
+#   pack a web site directory into a read-only file system image
+#   that httpd serves from, instead of opening individual DOS files.
+#
+#   image layout, all integers are little-endian:
+#
+#   header (20 bytes)
+#       char[4]     magic "WROM"
+#       uint16      version
+#       uint16      number of index entries
+#       uint32      offset of the first file content byte (end of meta data)
+#       uint32      image length
+#       uint16      checksum block size
+#       uint16      reserved
+#
+#   index (24 bytes per entry) sorted by path in byte order for binary search
+#       uint32      offset of NUL terminated path, ex. "/index.htm"
+#       uint32      offset of file content, aligned to ALIGN bytes
+#       uint32      file length
+#       uint32      ETag, CRC32 of the file content
+#       uint32      offset of NUL terminated MIME type string
+#       uint32      offset of file's block checksums
+#
+#   string table of paths and MIME type strings
+#   block checksums, one uint16 per BLOCK bytes of file content.
+#       the Internet checksum sum (non-inverted) of the block
+#       stored in network order, as stack_checksum() returns it
+#   file content
+#
+#==========================================================================
+from __future__ import print_function
+
+import os
+import sys
+import struct
+import zlib
+
+USAGE = "Usage: mkromfs.py <www directory> <image file> [-a <alignment>] [-b <block size>]"
+
+MAGIC = b'WROM'
+VERSION = 2
+HEADER_FMT = '<4sHHLLHH'
+ENTRY_FMT = '<LLLLLL'
+ALIGN = 16                          # paragraph aligned content
+BLOCK = 512                         # httpd reads a resource into TCP segments in BLOCK size chunks
+
+MIME_TYPES = { '.htm'  : 'text/html',
+               '.html' : 'text/html',
+               '.css'  : 'text/css',
+               '.txt'  : 'text/plain',
+               '.js'   : 'application/javascript',
+               '.json' : 'application/json',
+               '.xml'  : 'application/xml',
+               '.gif'  : 'image/gif',
+               '.png'  : 'image/png',
+               '.jpg'  : 'image/jpeg',
+               '.jpeg' : 'image/jpeg',
+               '.ico'  : 'image/x-icon',
+               '.svg'  : 'image/svg+xml' }
+DEFAULT_MIME = 'application/octet-stream'
+
+def align(offset, alignment):
+    return (offset + alignment - 1) // alignment * alignment
+
+def block_sums(data, block):
+    sums = b''
+    for start in range(0, len(data), block):
+        chunk = bytearray(data[start:start + block])
+        if len(chunk) & 1:
+            chunk.append(0)
+        acc = 0
+        for i in range(0, len(chunk), 2):
+            acc += (chunk[i] << 8) | chunk[i + 1]
+        while acc >> 16:
+            acc = (acc & 0xffff) + (acc >> 16)
+        sums += struct.pack('>H', acc)
+    return sums
+
+#==========================================================================
+# MAIN PROGRAM
+#==========================================================================
+if len(sys.argv) not in (3, 5, 7):
+    print(USAGE)
+    sys.exit(1)
+
+www_dir = sys.argv[1]
+image_file = sys.argv[2]
+for i in range(3, len(sys.argv), 2):
+    if sys.argv[i] == '-a':
+        ALIGN = int(sys.argv[i + 1])
+    elif sys.argv[i] == '-b':
+        BLOCK = int(sys.argv[i + 1])
+    else:
+        print(USAGE)
+        sys.exit(1)
+
+# collect files and their request paths
+files = []
+for root, dirs, names in os.walk(www_dir):
+    for name in names:
+        spec = os.path.join(root, name)
+        path = '/' + os.path.relpath(spec, www_dir).replace(os.sep, '/')
+        with open(spec, 'rb') as f:
+            content = f.read()
+        mime = MIME_TYPES.get(os.path.splitext(name)[1].lower(), DEFAULT_MIME)
+        files.append((path.encode('ascii'), mime.encode('ascii'), content))
+
+if len(files) == 0 or len(files) > 0xffff:
+    print("Nothing to pack, or too many files in %s" % www_dir)
+    sys.exit(1)
+
+files.sort(key=lambda entry: entry[0])
+
+# string table with paths, followed by MIME types stored only once
+strings = b''
+string_offset = {}
+str_base = struct.calcsize(HEADER_FMT) + len(files) * struct.calcsize(ENTRY_FMT)
+for text in [entry[0] for entry in files] + sorted(set([entry[1] for entry in files])):
+    if text not in string_offset:
+        string_offset[text] = str_base + len(strings)
+        strings += text + b'\0'
+
+# block checksums of each file follow the string table
+sums = b''
+sums_offset = []
+sums_base = align(str_base + len(strings), 2)
+for (path, mime, data) in files:
+    sums_offset.append(sums_base + len(sums))
+    sums += block_sums(data, BLOCK)
+
+# the meta data is loaded to memory by httpd, 16-bit size limit
+data_start = align(sums_base + len(sums), ALIGN)
+if data_start > 0xfff0:
+    print("Index too large (%d bytes)" % data_start)
+    sys.exit(1)
+
+# lay out file content and build the index
+index = b''
+content = b''
+offset = data_start
+for (n, (path, mime, data)) in enumerate(files):
+    content += b'\0' * (offset - data_start - len(content))
+    index += struct.pack(ENTRY_FMT, string_offset[path], offset, len(data),
+                         zlib.crc32(data) & 0xffffffff, string_offset[mime], sums_offset[n])
+    content += data
+    offset = align(offset + len(data), ALIGN)
+
+image_len = data_start + len(content)
+header = struct.pack(HEADER_FMT, MAGIC, VERSION, len(files), data_start, image_len, BLOCK, 0)
+image = header + index + strings
+image += b'\0' * (sums_base - len(image))
+image += sums
+image += b'\0' * (data_start - len(image))
+image += content
+
+with open(image_file, 'wb') as f:
+    f.write(image)
+
+for (path, mime, data) in files:
+    print("  %-40s %8d  %s" % (path.decode('ascii'), len(data), mime.decode('ascii')))
+print("%d files, %d bytes meta data, %d bytes image" % (len(files), data_start, image_len))